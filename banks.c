@@ -0,0 +1,87 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memsim2.h"
+
+// Bank splitting for ROM sets larger than one simulator, e.g. 1 MB in
+// two 27040 sockets. Bank n receives the image bytes from n * bank size
+// on, all banks are uploaded at the same time, one device each.
+
+// policy and cpu are passed to realtime_begin() for the transfer, < 0 to
+// leave them unchanged
+int
+upload_banks(const char *filename, long offset, const struct MemType *mem_type,
+      char **devices, int banks, const struct EmuConfig *config, int policy, int cpu)
+{
+   struct UploadJob jobs[MAX_DEVICES];
+   uint8_t *bank_mem = NULL;
+   long bank_size = mem_type_given ? mem_type->size : SIMMEMSIZE;
+   uint8_t *image;
+   long min, max;
+   int image_size;
+   int used;
+   int res = -1;
+   int i;
+
+   // The window covers all banks, the parsers place the data as usual
+   window_size = bank_size * banks;
+   image = calloc(window_size, 1);
+   if (!image)
+   {
+      perror("Error: Failed to allocate image buffer");
+      return -1;
+   }
+   image_size = read_image(filename, image, offset, &min, &max, NULL);
+   if (image_size < 0) goto out;
+   used = (image_size + bank_size - 1) / bank_size;
+   if (used == 0)
+   {
+      fprintf(stderr, "Error: No data in image\n");
+      goto out;
+   }
+   printf("Info: %d bytes split into %d bank(s) of %ld bytes\n", image_size, used, bank_size);
+   if (used < banks) printf("Info: %d device(s) not needed\n", banks - used);
+   // Checksums refer to the addresses seen by the CPU, across all banks
+   if (checksum_apply(image, used * bank_size) < 0) goto out;
+   // Own buffer per bank, mirroring of a small chip must not reach into
+   // the next bank while it is uploaded. One block, to lock it at once.
+   bank_mem = calloc(used, SIMMEMSIZE);
+   if (!bank_mem)
+   {
+      perror("Error: Failed to allocate bank buffers");
+      goto out;
+   }
+
+   for (i = 0; i < used; i++)
+   {
+      long start = i * bank_size;
+      int bytes = (image_size - start < bank_size) ? image_size - start : bank_size;
+      struct ChipPlan plan;
+
+      if (chip_plan(mem_type_given ? mem_type : NULL, bytes, &plan) < 0)
+      {
+         fprintf(stderr, "Error: Can't select chip type for %d bytes of bank %d\n", bytes, i);
+         goto out;
+      }
+      jobs[i].data = bank_mem + i * SIMMEMSIZE;
+      memcpy(jobs[i].data, image + start, plan.sim_size);
+      if (scramble_apply(jobs[i].data, plan.sim_size) < 0) goto out;
+      jobs[i].device = devices[i];
+      jobs[i].config = *config;
+      jobs[i].config.mem_type = plan.type;
+      jobs[i].size = plan.sim_size;
+      printf("Bank %d: %06lXh-%06lXh, %d bytes (%s) to %s\n", i, start, start + bytes - 1,
+            bytes, plan.type->name, devices[i]);
+   }
+   if (policy >= 0 || cpu >= 0)
+      realtime_begin(policy, cpu, policy >= 0 ? bank_mem : NULL, (size_t)used * SIMMEMSIZE);
+   res = upload_parallel(jobs, used);
+   realtime_end();
+out:
+   free(bank_mem);
+   free(image);
+   return res;
+}
@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "memsim2.h"
+
+// Batch mode: execute a script of commands against a single open device.
+//
+//    # comment
+//    set memtype 27256         # or auto
+//    set offset 0xE000         # or none
+//    set reset -100
+//    set emulation on          # or off
+//    upload firmware-a.hex
+//    config                    # send configuration only
+//    sleep 2
+//    wait build/done.flag 30   # wait up to 30 s for a file to appear
+//
+// Each step reports the time it took.
+
+static const char *errmsg = "Error in batch script";
+
+struct Batch
+{
+   int fd;
+   uint8_t *mem;
+   long offset;
+   const struct MemType *mem_type;   // selected or last used chip
+   struct EmuConfig config;
+};
+
+static double
+elapsed(const struct timespec *start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int
+parse_number(const char *arg, long *value)
+{
+   char *endptr;
+
+   if (!arg) return -1;
+   *value = strtol(arg, &endptr, 0);
+   return (*endptr == '\0') ? 0 : -1;
+}
+
+static int
+cmd_set(struct Batch *b, const char *key, const char *arg, int line)
+{
+   long value;
+
+   if (!key || !arg)
+   {
+      fprintf(stderr, "%s, line %d: set needs a name and a value\n", errmsg, line);
+      return -1;
+   }
+   if (!strcasecmp(key, "memtype"))
+   {
+      if (!strcasecmp(arg, "auto"))
+      {
+         mem_type_given = false;
+         return 0;
+      }
+      b->mem_type = find_mem_type(arg);
+      if (!b->mem_type)
+      {
+         fprintf(stderr, "%s, line %d: Unknown memory type\n", errmsg, line);
+         return -1;
+      }
+      mem_type_given = true;
+      return 0;
+   }
+   if (!strcasecmp(key, "offset"))
+   {
+      if (!strcasecmp(arg, "none"))
+      {
+         offset_given = false;
+         b->offset = 0;
+         return 0;
+      }
+      if (parse_number(arg, &b->offset) < 0) goto invalid;
+      offset_given = true;
+      return 0;
+   }
+   if (!strcasecmp(key, "reset"))
+   {
+      if (parse_number(arg, &value) < 0) goto invalid;
+      if (reset_config(value, &b->config) < 0)
+      {
+         fprintf(stderr, "%s, line %d: Reset time out of range\n", errmsg, line);
+         return -1;
+      }
+      return 0;
+   }
+   if (!strcasecmp(key, "emulation"))
+   {
+      if (!strcasecmp(arg, "on")) b->config.emu_enable = 'E';
+      else if (!strcasecmp(arg, "off")) b->config.emu_enable = 'D';
+      else goto invalid;
+      return 0;
+   }
+   fprintf(stderr, "%s, line %d: unknown setting '%s'\n", errmsg, line, key);
+   return -1;
+
+invalid:
+   fprintf(stderr, "%s, line %d: invalid value '%s'\n", errmsg, line, arg);
+   return -1;
+}
+
+static int
+cmd_upload(struct Batch *b, const char *filename)
+{
+   const struct MemType *mem_type = mem_type_given ? b->mem_type : NULL;
+   double cpu = stats_cpu();
+   int sim_size;
+   int res;
+
+   // One history and metrics record per upload step
+   memset(&stats, 0, sizeof(stats));
+   memset(b->mem, 0, SIMMEMSIZE);
+   if (prepare_image(filename, b->mem, b->offset, 1, &mem_type, &sim_size) < 0)
+      return -1;
+   b->config.mem_type = mem_type;
+   if (!mem_type_given) b->mem_type = mem_type;
+   res = send_image(b->fd, &b->config, b->mem, sim_size);
+   stats.cpu = stats_cpu() - cpu;
+   stats_record(&stats, device_name, mem_type->name, sim_size, res == 0);
+   return res;
+}
+
+static int
+cmd_wait(const char *filename, const char *arg, int line)
+{
+   struct timespec start;
+   struct stat st;
+   long timeout = 60;
+
+   if (arg && parse_number(arg, &timeout) < 0)
+   {
+      fprintf(stderr, "%s, line %d: invalid timeout '%s'\n", errmsg, line, arg);
+      return -1;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   while (stat(filename, &st) < 0)
+   {
+      const struct timespec poll_interval = { 0, 50 * 1000 * 1000 };
+
+      if (elapsed(&start) >= timeout)
+      {
+         fprintf(stderr, "Error: Timeout while waiting for '%s'\n", filename);
+         return -1;
+      }
+      nanosleep(&poll_interval, NULL);
+   }
+   return 0;
+}
+
+static int
+cmd_sleep(const char *arg, int line)
+{
+   struct timespec t;
+   char *endptr;
+   double seconds;
+
+   seconds = arg ? strtod(arg, &endptr) : -1;
+   if (!arg || *endptr != '\0' || seconds < 0)
+   {
+      fprintf(stderr, "%s, line %d: sleep needs a number of seconds\n", errmsg, line);
+      return -1;
+   }
+   t.tv_sec = (time_t)seconds;
+   t.tv_nsec = (long)((seconds - t.tv_sec) * 1e9);
+   while (nanosleep(&t, &t) < 0 && errno == EINTR);
+   return 0;
+}
+
+int
+run_batch(const char *script, int fd, uint8_t *mem, long offset,
+      const struct MemType *mem_type, const struct EmuConfig *config)
+{
+   struct Batch b;
+   struct timespec start, step_start;
+   char line[1024];
+   int number = 0;
+   int steps = 0;
+   FILE *file = fopen(script, "r");
+
+   if (!file)
+   {
+      fprintf(stderr, "Error: Failed to open batch script '%s': %s\n",
+            script, strerror(errno));
+      return -1;
+   }
+   b.fd = fd;
+   b.mem = mem;
+   b.offset = offset;
+   b.mem_type = mem_type;
+   b.config = *config;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   while (fgets(line, sizeof(line), file))
+   {
+      char *p = strchr(line, '#');
+      char *cmd, *arg1, *arg2;
+      int res;
+
+      number++;
+      if (p) *p = '\0';
+      cmd = strtok(line, " \t\r\n");
+      if (!cmd) continue;
+      arg1 = strtok(NULL, " \t\r\n");
+      arg2 = strtok(NULL, " \t\r\n");
+
+      steps++;
+      clock_gettime(CLOCK_MONOTONIC, &step_start);
+      printf("Step %d: %s %s %s\n", steps, cmd, arg1 ? arg1 : "", arg2 ? arg2 : "");
+      if (!strcasecmp(cmd, "set"))
+         res = cmd_set(&b, arg1, arg2, number);
+      else if (!strcasecmp(cmd, "upload"))
+      {
+         if (arg1) res = cmd_upload(&b, arg1);
+         else
+         {
+            fprintf(stderr, "%s, line %d: upload needs a file name\n", errmsg, number);
+            res = -1;
+         }
+      }
+      else if (!strcasecmp(cmd, "config"))
+      {
+         if (b.mem_type)
+         {
+            b.config.mem_type = b.mem_type;
+            res = memsim_config(fd, &b.config);
+         }
+         else
+         {
+            fprintf(stderr, "%s, line %d: config needs a memory type\n", errmsg, number);
+            res = -1;
+         }
+      }
+      else if (!strcasecmp(cmd, "sleep"))
+         res = cmd_sleep(arg1, number);
+      else if (!strcasecmp(cmd, "wait"))
+      {
+         if (arg1) res = cmd_wait(arg1, arg2, number);
+         else
+         {
+            fprintf(stderr, "%s, line %d: wait needs a file name\n", errmsg, number);
+            res = -1;
+         }
+      }
+      else
+      {
+         fprintf(stderr, "%s, line %d: unknown command '%s'\n", errmsg, number, cmd);
+         res = -1;
+      }
+      if (res < 0)
+      {
+         fprintf(stderr, "Error: batch aborted in step %d (line %d)\n", steps, number);
+         fclose(file);
+         return -1;
+      }
+      printf("Step %d: done in %.3f s\n", steps, elapsed(&step_start));
+   }
+   fclose(file);
+   printf("%d steps in %.3f s\n", steps, elapsed(&start));
+   return 0;
+}
@@ -0,0 +1,262 @@
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memsim2.h"
+
+// Capture of the serial traffic and replay against a pseudo terminal.
+//
+// A trace file starts with the magic "MSTRACE1", followed by one record
+// per write() or read() on the serial device:
+//
+//    1 byte   'W' host to simulator, 'R' simulator to host
+//    4 bytes  length, little endian
+//    8 bytes  nanoseconds since start of capture, little endian
+//    length bytes of data
+//
+// For replay, memsim2 acts as the simulator on a pseudo terminal: data
+// written by the host is compared with the 'W' records and the 'R'
+// records are sent back, either with the original timing or as fast as
+// possible.
+
+#define TRACE_MAGIC "MSTRACE1"
+#define HEADER_SIZE 13
+#define IDLE_TIMEOUT 10000     // ms without data from the host once started
+
+static FILE *trace;
+static struct timespec trace_start;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+ns_since(const struct timespec *start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000u + now.tv_nsec - start->tv_nsec;
+}
+
+static void
+capture_close(void)
+{
+   if (trace && fclose(trace) != 0)
+      perror("Error: Failed to write capture file");
+   trace = NULL;
+}
+
+int
+capture_open(const char *filename)
+{
+   trace = fopen(filename, "wb");
+   if (!trace)
+   {
+      fprintf(stderr, "Error: Failed to create capture file '%s': %s\n",
+            filename, strerror(errno));
+      return -1;
+   }
+   fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace);
+   clock_gettime(CLOCK_MONOTONIC, &trace_start);
+   atexit(capture_close);
+   return 0;
+}
+
+void
+capture_record(char direction, const uint8_t *data, size_t count)
+{
+   uint8_t header[HEADER_SIZE];
+   uint64_t t;
+   int i;
+
+   if (!trace) return;
+   t = ns_since(&trace_start);
+   header[0] = direction;
+   for (i = 0; i < 4; i++) header[1 + i] = (uint32_t)count >> (8 * i);
+   for (i = 0; i < 8; i++) header[5 + i] = t >> (8 * i);
+   pthread_mutex_lock(&trace_lock);
+   fwrite(header, 1, sizeof(header), trace);
+   fwrite(data, 1, count, trace);
+   pthread_mutex_unlock(&trace_lock);
+}
+
+static void
+sleep_until(const struct timespec *start, uint64_t ns)
+{
+   uint64_t elapsed = ns_since(start);
+   struct timespec t;
+
+   if (elapsed >= ns) return;
+   t.tv_sec = (ns - elapsed) / 1000000000u;
+   t.tv_nsec = (ns - elapsed) % 1000000000u;
+   nanosleep(&t, NULL);
+}
+
+static int
+read_record(FILE *file, char *direction, uint8_t **data, uint32_t *count, uint64_t *t)
+{
+   uint8_t header[HEADER_SIZE];
+   int i;
+
+   if (fread(header, 1, sizeof(header), file) != sizeof(header)) return 0;
+   *direction = header[0];
+   *count = 0;
+   *t = 0;
+   for (i = 3; i >= 0; i--) *count = (*count << 8) | header[1 + i];
+   for (i = 7; i >= 0; i--) *t = (*t << 8) | header[5 + i];
+   if ((*direction != 'W' && *direction != 'R') || *count > SIMMEMSIZE + 64)
+   {
+      fprintf(stderr, "Error: corrupt capture file\n");
+      return -1;
+   }
+   *data = malloc(*count ? *count : 1);
+   if (!*data || fread(*data, 1, *count, file) != *count)
+   {
+      fprintf(stderr, "Error: truncated capture file\n");
+      free(*data);
+      return -1;
+   }
+   return 1;
+}
+
+static int
+open_pty(int *slave)
+{
+   struct termios settings;
+   int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+   if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+   {
+      perror("Error: Failed to create pseudo terminal");
+      return -1;
+   }
+   // Keep the slave open so reads on the master block until the host
+   // opens the device instead of failing
+   *slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+   if (*slave < 0)
+   {
+      perror("Error: Failed to open pseudo terminal");
+      close(master);
+      return -1;
+   }
+   tcgetattr(*slave, &settings);
+   cfmakeraw(&settings);
+   tcsetattr(*slave, TCSANOW, &settings);
+   return master;
+}
+
+int
+replay(const char *filename, bool fast)
+{
+   char magic[sizeof(TRACE_MAGIC) - 1];
+   struct timespec start;
+   uint64_t t0 = 0;
+   uint64_t t = 0;
+   long records = 0;
+   long bytes_in = 0, bytes_out = 0, mismatches = 0;
+   bool started = false;
+   int master, slave;
+   int res;
+   FILE *file = fopen(filename, "rb");
+
+   if (!file)
+   {
+      fprintf(stderr, "Error: Failed to open capture file '%s': %s\n",
+            filename, strerror(errno));
+      return -1;
+   }
+   if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+       memcmp(magic, TRACE_MAGIC, sizeof(magic)))
+   {
+      fprintf(stderr, "Error: '%s' is not a capture file\n", filename);
+      fclose(file);
+      return -1;
+   }
+   master = open_pty(&slave);
+   if (master < 0)
+   {
+      fclose(file);
+      return -1;
+   }
+   printf("Replay device: %s\n", ptsname(master));
+   fflush(stdout);
+
+   while (1)
+   {
+      char direction;
+      uint8_t *data;
+      uint32_t count;
+
+      res = read_record(file, &direction, &data, &count, &t);
+      if (res <= 0) break;
+      records++;
+      if (direction == 'W')
+      {
+         uint8_t buffer[512];
+         uint32_t done = 0;
+
+         if (started && !fast) sleep_until(&start, t - t0);
+         while (done < count)
+         {
+            uint32_t portion = count - done < sizeof(buffer) ? count - done : sizeof(buffer);
+            struct pollfd fds = { master, POLLIN, 0 };
+            uint32_t i;
+            int r;
+
+            r = poll(&fds, 1, started ? IDLE_TIMEOUT : -1);
+            if (r > 0) r = read(master, buffer, portion);
+            if (r <= 0)
+            {
+               fprintf(stderr, "Error: host stopped sending after %ld records\n", records - 1);
+               res = -1;
+               break;
+            }
+            if (!started)
+            {
+               // Timing starts with the first byte from the host
+               clock_gettime(CLOCK_MONOTONIC, &start);
+               t0 = t;
+               started = true;
+            }
+            for (i = 0; i < (uint32_t)r; i++)
+               if (buffer[i] != data[done + i]) mismatches++;
+            done += r;
+         }
+         bytes_in += done;
+      }
+      else
+      {
+         if (started && !fast) sleep_until(&start, t - t0);
+         if (write(master, data, count) != (ssize_t)count)
+         {
+            perror("Error: Failed to write reply");
+            res = -1;
+         }
+         bytes_out += count;
+      }
+      free(data);
+      if (res < 0) break;
+   }
+   fclose(file);
+
+   printf("%ld records, %ld bytes from host, %ld bytes to host, %ld bytes differ\n",
+         records, bytes_in, bytes_out, mismatches);
+   if (started)
+      printf("Captured %.3f s, replayed in %.3f s\n",
+            (t - t0) / 1e9, ns_since(&start) / 1e9);
+   // Let the host read the last reply before the pseudo terminal vanishes
+   tcdrain(master);
+   usleep(100 * 1000);
+   close(slave);
+   close(master);
+   return (res < 0 || mismatches) ? -1 : 0;
+}
@@ -0,0 +1,267 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memsim2.h"
+
+// Parse-only validation of many image files, e.g. in CI without hardware.
+// Files are parsed on a pool of threads, each with its own image buffer
+// and coverage map. The messages of the parsers are suppressed, one report
+// line per file is printed in the order the files were given.
+
+#define MAX_RANGES_SHOWN 4
+
+struct CheckResult
+{
+   const char *filename;
+   bool checked;        // false if no worker got to it
+   int status;          // 0, CHECK_PARSE_ERROR or CHECK_SIZE_ERROR
+   int image_size;
+   int sim_size;
+   const char *chip;
+   long ranges;
+   long holes;
+   long hole_bytes;
+   long ignored;
+   long file_size;
+   double seconds;
+   char range_text[MAX_RANGES_SHOWN * 24 + 8];
+};
+
+struct CheckPool
+{
+   pthread_mutex_t lock;
+   struct CheckResult *results;
+   int count;
+   int next;            // next file to be checked
+   const struct MemType *mem_type;
+   long offset;
+   int lanes;
+};
+
+static double
+seconds_since(const struct timespec *start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Collect ranges of set bytes from the coverage map, gaps between them are holes
+static void
+scan_coverage(struct CheckResult *r, const struct Coverage *coverage)
+{
+   const uint8_t *map = coverage->map;
+   size_t used = 0;
+   long i = 0;
+   long last_end = -1;
+
+   r->range_text[0] = '\0';
+   while (i < window_size)
+   {
+      const uint8_t *p = memchr(map + i, 1, window_size - i);
+      long start, end;
+
+      if (!p) break;
+      start = p - map;
+      p = memchr(map + start, 0, window_size - start);
+      end = p ? p - map : window_size;
+      if (last_end >= 0)
+      {
+         r->holes++;
+         r->hole_bytes += start - last_end;
+      }
+      if (r->ranges < MAX_RANGES_SHOWN)
+         used += snprintf(r->range_text + used, sizeof(r->range_text) - used, " %04lXh-%04lXh",
+               coverage->base + start, coverage->base + end - 1);
+      else if (r->ranges == MAX_RANGES_SHOWN)
+         used += snprintf(r->range_text + used, sizeof(r->range_text) - used, " ...");
+      r->ranges++;
+      last_end = end;
+      i = end;
+   }
+}
+
+static void
+check_file(struct CheckPool *pool, struct CheckResult *r, uint8_t *mem, struct Coverage *coverage)
+{
+   struct ChipPlan plan;
+   struct timespec start;
+   struct stat st;
+   long min, max;
+   int detected_size;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   r->checked = true;
+   memset(mem, 0, window_size);
+   memset(coverage->map, 0, window_size);
+   coverage->base = 0;
+   coverage->ignored = 0;
+   if (stat(r->filename, &st) == 0) r->file_size = st.st_size;
+
+   r->image_size = read_image(r->filename, mem, pool->offset, &min, &max, coverage);
+   r->ignored = coverage->ignored;
+   if (r->image_size < 0)
+   {
+      // A binary too large for any chip fails before it is read
+      r->status = r->ignored ? CHECK_SIZE_ERROR : CHECK_PARSE_ERROR;
+      r->seconds = seconds_since(&start);
+      return;
+   }
+   detected_size = (r->image_size + pool->lanes - 1) / pool->lanes;
+   if (chip_plan(pool->mem_type, detected_size, &plan) == 0)
+   {
+      r->chip = plan.type->name;
+      r->sim_size = plan.sim_size;
+   }
+   // Data outside of the chip doesn't make it into the simulator
+   if (!r->chip || r->ignored)
+      r->status = CHECK_SIZE_ERROR;
+   scan_coverage(r, coverage);
+   r->seconds = seconds_since(&start);
+}
+
+static void *
+check_worker(void *arg)
+{
+   struct CheckPool *pool = arg;
+   struct Coverage coverage;
+   uint8_t *mem = malloc(window_size);
+
+   coverage.map = malloc(window_size);
+   if (!mem || !coverage.map)
+   {
+      // Files left over by all workers are reported as not checked
+      fprintf(stderr, "Error: Failed to allocate check buffers\n");
+      free(mem);
+      free(coverage.map);
+      return NULL;
+   }
+   while (1)
+   {
+      int i;
+
+      pthread_mutex_lock(&pool->lock);
+      i = pool->next++;
+      pthread_mutex_unlock(&pool->lock);
+      if (i >= pool->count) break;
+      check_file(pool, &pool->results[i], mem, &coverage);
+   }
+   free(mem);
+   free(coverage.map);
+   return NULL;
+}
+
+static void
+print_result(const struct CheckResult *r)
+{
+   if (!r->checked)
+   {
+      printf("%s: not checked\n", r->filename);
+      return;
+   }
+   if (r->status == CHECK_PARSE_ERROR)
+   {
+      printf("%s: parse error\n", r->filename);
+      return;
+   }
+   if (r->status == CHECK_SIZE_ERROR && r->image_size < 0)
+   {
+      printf("%s: size mismatch, %ld bytes too large\n", r->filename, r->ignored);
+      return;
+   }
+   printf("%s: %s%s, %d bytes", r->filename, r->status ? "size mismatch, " : "",
+         r->chip ? r->chip : "no chip", r->image_size);
+   printf(", %ld range%s%s", r->ranges, r->ranges == 1 ? "" : "s", r->range_text);
+   if (r->holes) printf(", %ld hole%s (%ld bytes)", r->holes, r->holes == 1 ? "" : "s", r->hole_bytes);
+   if (r->ignored) printf(", %ld bytes ignored", r->ignored);
+   printf(", %.3f s\n", r->seconds);
+}
+
+// Returns 0 if all files are fine, otherwise CHECK_PARSE_ERROR and/or
+// CHECK_SIZE_ERROR for the kinds of failures found
+int
+check_images(char **files, int count, const struct MemType *mem_type, long offset,
+      int lanes, int jobs)
+{
+   struct CheckPool pool;
+   pthread_t thread[MAX_CHECK_JOBS];
+   bool started[MAX_CHECK_JOBS];
+   struct timespec start;
+   double seconds;
+   double megabytes = 0;
+   int parse_errors = 0, size_errors = 0;
+   int status = 0;
+   int saved_stdout, null_fd;
+   int i;
+
+   if (jobs <= 0)
+   {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+      jobs = cpus > 0 ? cpus : 1;
+   }
+   if (jobs > MAX_CHECK_JOBS) jobs = MAX_CHECK_JOBS;
+   if (jobs > count) jobs = count;
+
+   pool.results = calloc(count, sizeof(*pool.results));
+   if (!pool.results)
+   {
+      perror("Error: Failed to allocate check results");
+      return CHECK_PARSE_ERROR;
+   }
+   for (i = 0; i < count; i++) pool.results[i].filename = files[i];
+   pthread_mutex_init(&pool.lock, NULL);
+   pool.count = count;
+   pool.next = 0;
+   pool.mem_type = mem_type;
+   pool.offset = offset;
+   pool.lanes = lanes;
+
+   // The parsers report to stdout, which would interleave between threads
+   fflush(stdout);
+   saved_stdout = dup(STDOUT_FILENO);
+   null_fd = open("/dev/null", O_WRONLY);
+   if (saved_stdout >= 0 && null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (i = 0; i < jobs; i++)
+   {
+      started[i] = pthread_create(&thread[i], NULL, check_worker, &pool) == 0;
+      if (!started[i]) check_worker(&pool);
+   }
+   for (i = 0; i < jobs; i++)
+      if (started[i]) pthread_join(thread[i], NULL);
+   seconds = seconds_since(&start);
+
+   fflush(stdout);
+   if (saved_stdout >= 0 && null_fd >= 0) dup2(saved_stdout, STDOUT_FILENO);
+   if (saved_stdout >= 0) close(saved_stdout);
+   if (null_fd >= 0) close(null_fd);
+   pthread_mutex_destroy(&pool.lock);
+
+   for (i = 0; i < count; i++)
+   {
+      struct CheckResult *r = &pool.results[i];
+
+      if (!r->checked) r->status = CHECK_PARSE_ERROR | CHECK_SIZE_ERROR;
+      print_result(r);
+      megabytes += r->file_size / 1e6;
+      if (r->status & CHECK_PARSE_ERROR) parse_errors++;
+      if (r->status & CHECK_SIZE_ERROR) size_errors++;
+      status |= r->status;
+   }
+   printf("%d files, %d parse errors, %d size mismatches, %.1f MB in %.3f s (%.1f MB/s, %d threads)\n",
+         count, parse_errors, size_errors, megabytes, seconds,
+         seconds > 0 ? megabytes / seconds : 0, jobs);
+   free(pool.results);
+   return status;
+}
@@ -0,0 +1,258 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "memsim2.h"
+
+// Checksums over ranges of the image, optionally stored in the image.
+//
+//    ALGORITHM[:START-END][@ADDRESS[,le|be]]
+//
+// ALGORITHM is sum8, sum16 (sum of all bytes truncated to 8 or 16 bits),
+// crc16 (CCITT, polynomial 0x1021, start 0xFFFF) or crc32 (IEEE 802.3).
+// Addresses are chip addresses starting at 0, END is inclusive. Without
+// a range the checksum covers the whole image or, if it is stored, all
+// bytes below ADDRESS. Checksums are computed in the order given, so a
+// later one can cover an earlier one.
+
+#define MAX_CHECKSUMS 8
+
+enum Algorithm { SUM8, SUM16, CRC16, CRC32 };
+
+struct Checksum
+{
+   enum Algorithm algorithm;
+   long start;
+   long end;            // inclusive, -1 for end of image
+   long address;        // -1 if only reported
+   bool big_endian;
+};
+
+static const struct
+{
+   const char *name;
+   int width;
+} algorithms[] =
+{
+   [SUM8] = { "sum8", 1 },
+   [SUM16] = { "sum16", 2 },
+   [CRC16] = { "crc16", 2 },
+   [CRC32] = { "crc32", 4 },
+};
+
+static struct Checksum checksums[MAX_CHECKSUMS];
+static int checksum_count;
+
+static uint16_t crc16_table[256];
+static uint32_t crc32_table[8][256];
+
+static void
+init_tables(void)
+{
+   int i, j;
+
+   for (i = 0; i < 256; i++)
+   {
+      uint16_t c16 = i << 8;
+      uint32_t c32 = i;
+
+      for (j = 0; j < 8; j++)
+      {
+         c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x1021 : c16 << 1;
+         c32 = (c32 & 1) ? (c32 >> 1) ^ 0xEDB88320 : c32 >> 1;
+      }
+      crc16_table[i] = c16;
+      crc32_table[0][i] = c32;
+   }
+   // Tables for slice-by-8: crc32_table[k][i] is i followed by k zero bytes
+   for (i = 0; i < 256; i++)
+      for (j = 1; j < 8; j++)
+         crc32_table[j][i] = (crc32_table[j - 1][i] >> 8) ^ crc32_table[0][crc32_table[j - 1][i] & 0xFF];
+}
+
+static uint32_t
+byte_sum(const uint8_t *data, size_t count)
+{
+   uint32_t sum = 0;
+   size_t i = 0;
+
+#if defined(__SSE2__)
+   __m128i acc = _mm_setzero_si128();
+
+   // PSADBW against zero adds 8 bytes into each 64 bit half
+   for (; i + 16 <= count; i += 16)
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(data + i)),
+               _mm_setzero_si128()));
+   sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+   for (; i < count; i++) sum += data[i];
+   return sum;
+}
+
+static uint16_t
+crc16(const uint8_t *data, size_t count)
+{
+   uint16_t crc = 0xFFFF;
+   size_t i;
+
+   for (i = 0; i < count; i++)
+      crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ data[i]];
+   return crc;
+}
+
+static uint32_t
+crc32(const uint8_t *data, size_t count)
+{
+   uint32_t crc = 0xFFFFFFFF;
+   size_t i = 0;
+
+   // Slice-by-8: fold 8 bytes per step with independent table lookups
+   for (; i + 8 <= count; i += 8)
+   {
+      uint32_t lo = crc ^ (data[i] | data[i + 1] << 8 | data[i + 2] << 16 | (uint32_t)data[i + 3] << 24);
+      uint32_t hi = data[i + 4] | data[i + 5] << 8 | data[i + 6] << 16 | (uint32_t)data[i + 7] << 24;
+
+      crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+            crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+            crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+            crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+   }
+   for (; i < count; i++)
+      crc = (crc >> 8) ^ crc32_table[0][(crc ^ data[i]) & 0xFF];
+   return ~crc;
+}
+
+// Parse a checksum specification given with -c
+int
+checksum_add(const char *spec)
+{
+   struct Checksum *c = &checksums[checksum_count];
+   const char *p = spec;
+   char *endptr;
+   size_t len;
+   unsigned int i;
+
+   if (checksum_count == MAX_CHECKSUMS)
+   {
+      fprintf(stderr, "Error: Too many checksums (max. %d)\n", MAX_CHECKSUMS);
+      return -1;
+   }
+   len = strcspn(p, ":@");
+   for (i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++)
+      if (strlen(algorithms[i].name) == len && !strncasecmp(p, algorithms[i].name, len)) break;
+   if (i == sizeof(algorithms) / sizeof(algorithms[0]))
+   {
+      fprintf(stderr, "Error: Unknown checksum '%.*s', use sum8, sum16, crc16 or crc32\n", (int)len, p);
+      return -1;
+   }
+   c->algorithm = i;
+   c->start = 0;
+   c->end = -1;
+   c->address = -1;
+   c->big_endian = false;
+   p += len;
+   if (*p == ':')
+   {
+      c->start = strtol(p + 1, &endptr, 0);
+      if (c->start < 0 || *endptr != '-') goto invalid;
+      c->end = strtol(endptr + 1, &endptr, 0);
+      if (c->end < c->start) goto invalid;
+      p = endptr;
+   }
+   if (*p == '@')
+   {
+      c->address = strtol(p + 1, &endptr, 0);
+      if (c->address < 0) goto invalid;
+      p = endptr;
+      if (*p == ',')
+      {
+         if (!strcasecmp(p + 1, "be")) c->big_endian = true;
+         else if (strcasecmp(p + 1, "le")) goto invalid;
+         p += strlen(p);
+      }
+   }
+   if (*p != '\0') goto invalid;
+   checksum_count++;
+   return 0;
+
+invalid:
+   fprintf(stderr, "Error: Invalid checksum specification '%s'\n", spec);
+   return -1;
+}
+
+bool
+checksum_active(void)
+{
+   return checksum_count > 0;
+}
+
+// Compute all checksums over mem, store them if requested and print them
+int
+checksum_apply(uint8_t *mem, int size)
+{
+   int n;
+
+   if (!checksum_count) return 0;
+   if (!crc16_table[1]) init_tables();
+   for (n = 0; n < checksum_count; n++)
+   {
+      const struct Checksum *c = &checksums[n];
+      int width = algorithms[c->algorithm].width;
+      long end = c->end;
+      uint32_t value = 0;
+      int i;
+
+      if (end < 0) end = (c->address >= 0 ? c->address : size) - 1;
+      if (c->start >= size || end >= size || (c->address >= 0 && c->address + width > size))
+      {
+         fprintf(stderr, "Error: %s range or address outside of the %d bytes image\n",
+               algorithms[c->algorithm].name, size);
+         return -1;
+      }
+      if (end < c->start)
+      {
+         fprintf(stderr, "Error: %s range is empty\n", algorithms[c->algorithm].name);
+         return -1;
+      }
+      if (c->address >= 0 && c->address <= end && c->address + width > c->start)
+      {
+         fprintf(stderr, "Error: %s stored inside its own range\n", algorithms[c->algorithm].name);
+         return -1;
+      }
+      switch (c->algorithm)
+      {
+         case SUM8:
+            value = byte_sum(mem + c->start, end - c->start + 1) & 0xFF;
+            break;
+         case SUM16:
+            value = byte_sum(mem + c->start, end - c->start + 1) & 0xFFFF;
+            break;
+         case CRC16:
+            value = crc16(mem + c->start, end - c->start + 1);
+            break;
+         case CRC32:
+            value = crc32(mem + c->start, end - c->start + 1);
+            break;
+      }
+      printf("Info: %s %04lXh-%04lXh = %0*X", algorithms[c->algorithm].name,
+            c->start, end, 2 * width, value);
+      if (c->address >= 0)
+      {
+         for (i = 0; i < width; i++)
+         {
+            int shift = 8 * (c->big_endian ? width - 1 - i : i);
+
+            mem[c->address + i] = value >> shift;
+         }
+         printf(", stored at %04lXh %s", c->address, c->big_endian ? "big endian" : "little endian");
+      }
+      printf("\n");
+   }
+   return 0;
+}
@@ -0,0 +1,272 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "memsim2.h"
+
+// Chip selection: the built-in EPROM types plus custom profiles from a
+// file, and a table mapping image sizes in KB to the smallest fitting
+// chip, so selection takes a single lookup.
+//
+// The memSIM2 knows 7 chip types with 8 KB to 512 KB. Smaller chips are
+// simulated by mirroring the image to 8 KB, chips with sizes that don't
+// divide the simulated size are padded.
+
+#define MAX_CUSTOM_TYPES 16
+
+static const struct MemType builtin_types[] =
+{
+   { "2716",  '0',   2 * 1024 },
+   { "2732",  '0',   4 * 1024 },
+   { "2764",  '0',   8 * 1024 },
+   { "27128", '1',  16 * 1024 },
+   { "27256", '2',  32 * 1024 },
+   { "27512", '3',  64 * 1024 },
+   { "27010", '4', 128 * 1024 },
+   { "27020", '5', 256 * 1024 },
+   { "27040", '6', 512 * 1024 }
+};
+
+#define BUILTIN_TYPES (sizeof(builtin_types) / sizeof(builtin_types[0]))
+
+static struct MemType custom_types[MAX_CUSTOM_TYPES];
+static int custom_count;
+
+// Smallest chip for each size in KB, built on first use
+static const struct MemType *by_kb[SIMMEMSIZE / 1024 + 1];
+static bool table_ready;
+
+static void
+build_table(void)
+{
+   int kb;
+
+   for (kb = 0; kb <= SIMMEMSIZE / 1024; kb++)
+   {
+      const struct MemType *best = NULL;
+      unsigned int i;
+      int j;
+
+      // Built-in types come first, so they win over custom types of equal size
+      for (i = 0; i < BUILTIN_TYPES; i++)
+         if (builtin_types[i].size >= kb * 1024 && (!best || builtin_types[i].size < best->size))
+            best = &builtin_types[i];
+      for (j = 0; j < custom_count; j++)
+         if (custom_types[j].size >= kb * 1024 && (!best || custom_types[j].size < best->size))
+            best = &custom_types[j];
+      by_kb[kb] = best;
+   }
+   table_ready = true;
+}
+
+const struct MemType *
+find_mem_type(const char *name)
+{
+   unsigned int i;
+   int j;
+
+   for (i = 0; i < BUILTIN_TYPES; i++)
+      if (strcmp(name, builtin_types[i].name) == 0) return &builtin_types[i];
+   for (j = 0; j < custom_count; j++)
+      if (strcasecmp(name, custom_types[j].name) == 0) return &custom_types[j];
+   return NULL;
+}
+
+// Bytes actually sent to the simulator for a chip
+int
+chip_send_size(const struct MemType *mem_type)
+{
+   return (8 * 1024) << (mem_type->cmd - '0');
+}
+
+static long
+parse_size(const char *arg)
+{
+   char *endptr;
+   long value = strtol(arg, &endptr, 0);
+
+   if (toupper((unsigned char)*endptr) == 'K')
+   {
+      value *= 1024;
+      endptr++;
+   }
+   return (*endptr == '\0') ? value : -1;
+}
+
+// Load custom chip profiles, one per line:
+//
+//    # name   size   simulated as
+//    2716A    2K     2716
+//    X24K     24K    27256
+//
+// The size must be a multiple of 1 KB and fit into the simulated chip.
+int
+chip_load_profiles(const char *filename)
+{
+   char line[256];
+   int number = 0;
+   FILE *file = fopen(filename, "r");
+
+   if (!file)
+   {
+      fprintf(stderr, "Error: Failed to open chip profiles '%s': %s\n", filename, strerror(errno));
+      return -1;
+   }
+   while (fgets(line, sizeof(line), file))
+   {
+      char *p = strchr(line, '#');
+      char *name, *size, *base;
+      const struct MemType *base_type;
+      unsigned int i;
+      long bytes;
+
+      number++;
+      if (p) *p = '\0';
+      name = strtok(line, " \t\r\n");
+      if (!name) continue;
+      size = strtok(NULL, " \t\r\n");
+      base = strtok(NULL, " \t\r\n");
+      if (!size || !base)
+      {
+         fprintf(stderr, "Error in chip profiles, line %d: name, size and chip type expected\n", number);
+         goto error;
+      }
+      base_type = NULL;
+      for (i = 0; i < BUILTIN_TYPES; i++)
+         if (!strcmp(base, builtin_types[i].name)) base_type = &builtin_types[i];
+      if (!base_type)
+      {
+         fprintf(stderr, "Error in chip profiles, line %d: unknown chip type '%s'\n", number, base);
+         goto error;
+      }
+      bytes = parse_size(size);
+      if (bytes <= 0 || bytes % 1024 || bytes > chip_send_size(base_type))
+      {
+         fprintf(stderr, "Error in chip profiles, line %d: invalid size '%s'\n", number, size);
+         goto error;
+      }
+      if (find_mem_type(name))
+      {
+         fprintf(stderr, "Error in chip profiles, line %d: '%s' already defined\n", number, name);
+         goto error;
+      }
+      if (custom_count == MAX_CUSTOM_TYPES)
+      {
+         fprintf(stderr, "Error in chip profiles, line %d: too many chips (max. %d)\n",
+               number, MAX_CUSTOM_TYPES);
+         goto error;
+      }
+      custom_types[custom_count].name = strdup(name);
+      custom_types[custom_count].cmd = base_type->cmd;
+      custom_types[custom_count].size = bytes;
+      custom_count++;
+   }
+   fclose(file);
+   table_ready = false;
+   return 0;
+
+error:
+   fclose(file);
+   return -1;
+}
+
+// Check that the custom chips can be used with the board profile
+int
+chip_check_profiles(void)
+{
+   int i;
+
+   for (i = 0; i < custom_count; i++)
+   {
+      if (!scramble_fits(custom_types[i].size))
+      {
+         fprintf(stderr, "Error: %d bytes of chip %s don't fit the address lines of the board profile\n",
+               custom_types[i].size, custom_types[i].name);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+// Plan the upload of detected_size bytes. mem_type is the chip given by
+// the user or NULL to select one by size. Returns -1 if no chip fits.
+int
+chip_plan(const struct MemType *mem_type, int detected_size, struct ChipPlan *plan)
+{
+   int kb = (detected_size + 1023) / 1024;
+
+   if (!table_ready) build_table();
+   memset(plan, 0, sizeof(*plan));
+   plan->image_size = detected_size;
+   if (kb > SIMMEMSIZE / 1024) return -1;
+   plan->standard_size = by_kb[kb] && by_kb[kb]->size == detected_size;
+   if (!mem_type)
+   {
+      mem_type = by_kb[kb];
+      if (!mem_type) return -1;
+   }
+   plan->type = mem_type;
+   if (detected_size > mem_type->size) return -1;
+   plan->sim_size = mem_type->size;
+   plan->send_size = chip_send_size(mem_type);
+   plan->copies = (plan->send_size % plan->sim_size == 0) ? plan->send_size / plan->sim_size : 1;
+   plan->padding = plan->sim_size - detected_size;
+   return 0;
+}
+
+// Select the chip for detected_size bytes of data and the size to
+// simulate. mem_type is only used if mem_type_given. Returns NULL if
+// no chip fits.
+const struct MemType *
+select_mem_type(const struct MemType *mem_type, int detected_size, int *sim_size)
+{
+   struct ChipPlan plan;
+
+   if (chip_plan(mem_type_given ? mem_type : NULL, detected_size, &plan) < 0)
+   {
+      if (mem_type_given)
+         fprintf(stderr, "Too much data (%d bytes) for specified memory type (%d bytes)\n",
+               detected_size, mem_type->size);
+      else
+         fprintf(stderr, "Can't autodetect chip type for %d bytes\n", detected_size);
+      return NULL;
+   }
+   if (!plan.standard_size)
+   {
+      printf("Warning: non-standard binary size of %d bytes\n", detected_size);
+      if (!mem_type_given) printf("Simulated size increased to %d bytes\n", plan.sim_size);
+   }
+   if (mem_type_given && detected_size != plan.sim_size)
+      printf("Warning: binary size (%d bytes) doesn't match memory size (%d bytes)\n",
+            detected_size, plan.sim_size);
+   if (!mem_type_given)
+      printf("%d bytes, must be a %s chip.\n", plan.sim_size, plan.type->name);
+   *sim_size = plan.sim_size;
+   return plan.type;
+}
+
+// Fill up the simulated chip: small chips are mirrored, odd sizes padded.
+// Returns the number of copies, used to fake the progress bar.
+int
+mirror_small_image(uint8_t *mem, const struct MemType *mem_type, int *sim_size)
+{
+   int send_size = chip_send_size(mem_type);
+   int copies = 1;
+   int i;
+
+   if (*sim_size >= send_size) return 1;
+   if (send_size % *sim_size == 0)
+   {
+      copies = send_size / *sim_size;
+      for (i = 1; i < copies; i++) memcpy(mem + i * *sim_size, mem, *sim_size);
+   }
+   else
+      memset(mem + *sim_size, 0, send_size - *sim_size);
+   *sim_size = send_size;
+   return copies;
+}
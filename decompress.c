@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "memsim2.h"
+
+// Compressed images are decompressed on the fly by gzip, xz or zstd in a
+// helper process, so decompression runs in parallel to parsing and no
+// temporary file is needed. The parsers read from the pipe like from
+// the file itself. Exported images are compressed the same way.
+
+struct Decompressor
+{
+   const char *suffix;
+   const uint8_t magic[6];
+   size_t magic_size;
+   const char *command;
+   const char *compress;
+};
+
+static const struct Decompressor decompressors[] =
+{
+   { "gz",  { 0x1F, 0x8B }, 2, "gzip -dc", "gzip -c" },
+   { "xz",  { 0xFD, '7', 'z', 'X', 'Z', 0x00 }, 6, "xz -dc", "xz -c" },
+   { "zst", { 0x28, 0xB5, 0x2F, 0xFD }, 4, "zstd -dcq", "zstd -cq" },
+};
+
+#define DECOMPRESSORS (sizeof(decompressors) / sizeof(decompressors[0]))
+
+// Returns the length of a compression suffix at the end of filename,
+// including the dot, or 0
+size_t
+compressed_suffix(const char *filename)
+{
+   const char *suffix = rindex(filename, '.');
+   unsigned int i;
+
+   if (!suffix) return 0;
+   for (i = 0; i < DECOMPRESSORS; i++)
+      if (!strcasecmp(suffix + 1, decompressors[i].suffix)) return strlen(suffix);
+   return 0;
+}
+
+// The suffix decides, magic bytes only for compressed suffixes, which may
+// name the wrong compressor, and for files without a known suffix. A raw
+// binary may start with the bytes of a magic number.
+static const struct Decompressor *
+find_decompressor(const char *filename, FILE *file)
+{
+   uint8_t magic[6];
+   size_t len = compressed_suffix(filename);
+   enum ImageFormat format = image_format(filename);
+   const struct Decompressor *by_suffix = NULL;
+   size_t n;
+   unsigned int i;
+
+   if (!len && format != FORMAT_NONE && format != FORMAT_UNKNOWN) return NULL;
+   n = fread(magic, 1, sizeof(magic), file);
+   rewind(file);
+   for (i = 0; i < DECOMPRESSORS; i++)
+   {
+      const struct Decompressor *d = &decompressors[i];
+
+      if (n >= d->magic_size && !memcmp(magic, d->magic, d->magic_size)) return d;
+      if (len && !strcasecmp(filename + strlen(filename) - len + 1, d->suffix)) by_suffix = d;
+   }
+   return by_suffix;
+}
+
+// Shell command "command op 'filename'" with the file name quoted, ' becomes '\''
+static char *
+shell_command(const char *command, const char *op, const char *filename)
+{
+   char *line;
+   const char *p;
+   size_t len;
+
+   len = strlen(command) + strlen(op) + 5;
+   for (p = filename; *p; p++) len += (*p == '\'') ? 4 : 1;
+   line = malloc(len);
+   if (!line) return NULL;
+   len = sprintf(line, "%s %s '", command, op);
+   for (p = filename; *p; p++)
+   {
+      if (*p == '\'')
+      {
+         memcpy(line + len, "'\\''", 4);
+         len += 4;
+      }
+      else
+         line[len++] = *p;
+   }
+   strcpy(line + len, "'");
+   return line;
+}
+
+// Open an image file, compressed files through a decompressing pipe.
+// Close with image_close().
+FILE *
+image_open(const char *filename, bool *piped)
+{
+   const struct Decompressor *d;
+   FILE *file;
+   char *command;
+
+   *piped = false;
+   if (memfd_is(filename)) return memfd_open();
+   file = fopen(filename, "rb");
+   if (!file) return NULL;
+   d = find_decompressor(filename, file);
+   if (!d) return file;
+   fclose(file);
+
+   command = shell_command(d->command, "--", filename);
+   if (!command) return NULL;
+   fflush(NULL);
+   file = popen(command, "r");
+   free(command);
+   if (file)
+   {
+      *piped = true;
+      printf("Info: decompressing with %s\n", d->command);
+   }
+   return file;
+}
+
+// Create a file for writing, through a compressing pipe if its suffix
+// names a compressor. Close with image_close().
+FILE *
+image_create(const char *filename, bool *piped)
+{
+   size_t len = compressed_suffix(filename);
+   FILE *file;
+   char *command;
+   unsigned int i;
+
+   *piped = false;
+   // Errors creating the file are reported here, not by the shell
+   file = fopen(filename, "wb");
+   if (!file || !len) return file;
+   fclose(file);
+   // A compressor that fails makes writes fail instead of killing memsim2
+   signal(SIGPIPE, SIG_IGN);
+   for (i = 0; i < DECOMPRESSORS; i++)
+      if (!strcasecmp(filename + strlen(filename) - len + 1, decompressors[i].suffix)) break;
+   command = shell_command(decompressors[i].compress, ">", filename);
+   if (!command) return NULL;
+   fflush(NULL);
+   file = popen(command, "w");
+   free(command);
+   if (file)
+   {
+      *piped = true;
+      printf("Info: compressing with %s\n", decompressors[i].compress);
+   }
+   return file;
+}
+
+int
+image_close(FILE *file, bool piped)
+{
+   int status;
+
+   if (!piped) return fclose(file);
+   status = pclose(file);
+   return status == 0 ? 0 : -1;
+}
@@ -0,0 +1,149 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memsim2.h"
+
+// Diagnostics of a simulator and its cable: the round trip time of the
+// configuration handshake and the throughput of data transfers of
+// several sizes. The memSIM2 only talks at BPS, so the throughput is
+// compared with the line rate at that speed. The test pattern overwrites
+// the simulated memory, emulation is disabled.
+//
+// The protocol has no documented command to start the self-test, so it
+// isn't run.
+
+#define PATTERN_BYTES (512 * 1024)      // sent for each transfer size
+#define MIN_TRANSFERS 10                // samples for each transfer size
+#define LARGE_SIZE (64 * 1024)          // larger sizes only with -m
+
+static const char *sizes[] = { "2764", "27512", "27040" };
+
+static void
+print_samples(const char *what, double *samples, int count, double scale, const char *unit)
+{
+   stats_sort(samples, count);
+   printf("%s: %d samples, p50 %.2f %s, p90 %.2f %s, p99 %.2f %s, max %.2f %s\n", what, count,
+         stats_percentile(samples, count, 50) * scale, unit,
+         stats_percentile(samples, count, 90) * scale, unit,
+         stats_percentile(samples, count, 99) * scale, unit,
+         samples[count - 1] * scale, unit);
+}
+
+static int
+handshake(int fd, const struct EmuConfig *config, int iterations)
+{
+   double *rtt = malloc(iterations * sizeof(*rtt));
+   int i;
+
+   if (!rtt)
+   {
+      perror("Error: Failed to allocate samples");
+      return -1;
+   }
+   for (i = 0; i < iterations; i++)
+   {
+      double start = stats_now();
+
+      if (memsim_config(fd, config) < 0)
+      {
+         free(rtt);
+         return -1;
+      }
+      rtt[i] = stats_now() - start;
+   }
+   print_samples("Handshake round trip", rtt, iterations, 1e3, "ms");
+   free(rtt);
+   return 0;
+}
+
+// Throughput of transfers of the chip sizes in sizes[], the slowest
+// transfers are the interesting ones, so percentiles are taken from below
+static int
+throughput(int fd, const struct EmuConfig *config, uint8_t *pattern)
+{
+   double line_rate = BPS / 10.0;      // 8N1
+   unsigned int s;
+
+   printf("Throughput at %d baud, line rate %.1f KB/s:\n", BPS, line_rate / 1024);
+   for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+   {
+      struct EmuConfig test = *config;
+      int count;
+      double *rate;
+      int i;
+
+      test.mem_type = find_mem_type(sizes[s]);
+      // Ten transfers of 512 KB take two minutes, only if asked for
+      if (test.mem_type->size > LARGE_SIZE &&
+          (!mem_type_given || config->mem_type->size < test.mem_type->size))
+      {
+         printf("%8d bytes: skipped, select with -m %s\n", test.mem_type->size, sizes[s]);
+         continue;
+      }
+      count = PATTERN_BYTES / test.mem_type->size;
+      if (count < MIN_TRANSFERS) count = MIN_TRANSFERS;
+      rate = malloc(count * sizeof(*rate));
+      if (!rate)
+      {
+         perror("Error: Failed to allocate samples");
+         return -1;
+      }
+      if (memsim_config(fd, &test) < 0)
+      {
+         free(rate);
+         return -1;
+      }
+      for (i = 0; i < count; i++)
+      {
+         double start = stats_now();
+
+         if (memsim_upload(fd, pattern, test.mem_type->size, false, 1) < 0)
+         {
+            free(rate);
+            return -1;
+         }
+         rate[i] = test.mem_type->size / (stats_now() - start);
+      }
+      stats_sort(rate, count);
+      printf("%8d bytes: %d transfers, p50 %.1f KB/s, p10 %.1f KB/s, min %.1f KB/s (%.0f%% of line rate)\n",
+            test.mem_type->size, count, stats_percentile(rate, count, 50) / 1024,
+            stats_percentile(rate, count, 10) / 1024, rate[0] / 1024,
+            100 * stats_percentile(rate, count, 50) / line_rate);
+      free(rate);
+   }
+   return 0;
+}
+
+int
+run_diagnostics(const char *device, const struct EmuConfig *config, int iterations)
+{
+   struct EmuConfig test = *config;
+   uint8_t *pattern;
+   int fd;
+   int res = -1;
+   int i;
+
+   pattern = malloc(SIMMEMSIZE);
+   if (!pattern)
+   {
+      perror("Error: Failed to allocate test pattern");
+      return -1;
+   }
+   for (i = 0; i < SIMMEMSIZE; i++) pattern[i] = i * 7 + (i >> 8);
+   fd = open_device(device);
+   if (fd < 0)
+   {
+      free(pattern);
+      return -1;
+   }
+   printf("Diagnostics of %s, the simulated memory is overwritten\n", device_name);
+   test.emu_enable = 'D';
+   if (handshake(fd, &test, iterations) == 0 && throughput(fd, &test, pattern) == 0) res = 0;
+   close(fd);
+   free(pattern);
+   return res;
+}
@@ -0,0 +1,224 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "memsim2.h"
+
+// Export of the image as sent to the simulator, as raw binary, Intel hex
+// or Motorola S-record. Records are encoded with a lookup table into an
+// output buffer that is written in large blocks.
+
+#define OUT_BUFFER_SIZE 65536
+#define RECORD_BYTES 32         // data bytes per record
+
+struct Writer
+{
+   FILE *file;
+   size_t used;
+   int error;
+   char buffer[OUT_BUFFER_SIZE];
+};
+
+static char hex_pairs[256][2];
+
+static void
+init_hex_pairs(void)
+{
+   static const char digits[] = "0123456789ABCDEF";
+   int i;
+
+   for (i = 0; i < 256; i++)
+   {
+      hex_pairs[i][0] = digits[i >> 4];
+      hex_pairs[i][1] = digits[i & 0xF];
+   }
+}
+
+static void
+flush_writer(struct Writer *w)
+{
+   if (w->used && fwrite(w->buffer, 1, w->used, w->file) != w->used) w->error = 1;
+   w->used = 0;
+}
+
+// Reserve space for one record, at most 2 * (RECORD_BYTES + 6) + 4 chars
+static char *
+reserve(struct Writer *w)
+{
+   if (w->used + 2 * (RECORD_BYTES + 6) + 4 > sizeof(w->buffer)) flush_writer(w);
+   return w->buffer + w->used;
+}
+
+// Append bytes as hex digits, adds them to the checksum
+static char *
+put_hex(char *p, const uint8_t *data, int count, unsigned int *sum)
+{
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      memcpy(p, hex_pairs[data[i]], 2);
+      p += 2;
+      *sum += data[i];
+   }
+   return p;
+}
+
+// Intel hex record: ':' count address(16) type data checksum
+static void
+ihex_record(struct Writer *w, int type, unsigned int addr, const uint8_t *data, int count)
+{
+   uint8_t header[4] = { count, addr >> 8, addr, type };
+   unsigned int sum = 0;
+   char *start = reserve(w);
+   char *p = start;
+
+   *p++ = ':';
+   p = put_hex(p, header, 4, &sum);
+   p = put_hex(p, data, count, &sum);
+   memcpy(p, hex_pairs[(uint8_t)-sum], 2);
+   p += 2;
+   *p++ = '\n';
+   w->used += p - start;
+}
+
+// S-record: 'S' type count address data checksum, count includes
+// address and checksum
+static void
+srec_record(struct Writer *w, char type, int addr_bytes, unsigned long addr,
+      const uint8_t *data, int count)
+{
+   uint8_t header[5];
+   unsigned int sum = 0;
+   char *start = reserve(w);
+   char *p = start;
+   int i;
+
+   header[0] = count + addr_bytes + 1;
+   for (i = 0; i < addr_bytes; i++) header[1 + i] = addr >> (8 * (addr_bytes - 1 - i));
+   *p++ = 'S';
+   *p++ = type;
+   p = put_hex(p, header, addr_bytes + 1, &sum);
+   p = put_hex(p, data, count, &sum);
+   memcpy(p, hex_pairs[(uint8_t)~sum], 2);
+   p += 2;
+   *p++ = '\n';
+   w->used += p - start;
+}
+
+static void
+write_ihex(struct Writer *w, const uint8_t *data, int size)
+{
+   int addr;
+
+   for (addr = 0; addr < size; addr += RECORD_BYTES)
+   {
+      int count = (size - addr < RECORD_BYTES) ? size - addr : RECORD_BYTES;
+
+      if (addr && (addr & 0xFFFF) == 0)
+      {
+         uint8_t upper[2] = { addr >> 24, addr >> 16 };
+
+         ihex_record(w, 4, 0, upper, 2);
+      }
+      ihex_record(w, 0, addr & 0xFFFF, data + addr, count);
+   }
+   ihex_record(w, 1, 0, NULL, 0);
+}
+
+// Address size of the S-records for filename: given by .s19, .s28 or .s37,
+// otherwise the smallest that holds size bytes. Returns -1 if too small.
+static int
+srec_addr_bytes(const char *filename, int size)
+{
+   size_t len = strlen(filename) - compressed_suffix(filename);
+   int addr_bytes = (size <= 0x10000) ? 2 : 3;
+
+   if (len >= 4 && !strncasecmp(filename + len - 4, ".s19", 4)) return (size <= 0x10000) ? 2 : -1;
+   if (len >= 4 && !strncasecmp(filename + len - 4, ".s28", 4)) return 3;
+   if (len >= 4 && !strncasecmp(filename + len - 4, ".s37", 4)) return 4;
+   return addr_bytes;
+}
+
+static void
+write_srec(struct Writer *w, const uint8_t *data, int size, int addr_bytes)
+{
+   static const uint8_t header[] = "memsim2";
+   // S1/S9 for 16 bit, S2/S8 for 24 bit, S3/S7 for 32 bit addresses
+   char type = '1' + addr_bytes - 2;
+   long records = 0;
+   int addr;
+
+   srec_record(w, '0', 2, 0, header, sizeof(header) - 1);
+   for (addr = 0; addr < size; addr += RECORD_BYTES)
+   {
+      int count = (size - addr < RECORD_BYTES) ? size - addr : RECORD_BYTES;
+
+      srec_record(w, type, addr_bytes, addr, data + addr, count);
+      records++;
+   }
+   // S5/S6 record count
+   if (records <= 0xFFFF)
+      srec_record(w, '5', 2, records, NULL, 0);
+   else
+      srec_record(w, '6', 3, records, NULL, 0);
+   srec_record(w, '9' - (addr_bytes - 2), addr_bytes, 0, NULL, 0);
+}
+
+// Write size bytes of data to filename, format chosen by the suffix like
+// for reading, e.g. firmware.s37 or firmware.hex.gz
+int
+export_image(const char *filename, const uint8_t *data, int size)
+{
+   static struct Writer w;
+   enum ImageFormat format = image_format(filename);
+   int addr_bytes = 0;
+   bool piped;
+
+   if (format != FORMAT_IHEX && format != FORMAT_SREC && format != FORMAT_BINARY)
+   {
+      fprintf(stderr, "Error: Unknown export format, use .bin, .hex, .s19, .s28 or .s37, "
+            "optionally with .gz, .xz or .zst\n");
+      return -1;
+   }
+   if (format == FORMAT_SREC)
+   {
+      addr_bytes = srec_addr_bytes(filename, size);
+      if (addr_bytes < 0)
+      {
+         fprintf(stderr, "Error: %d bytes need 24 bit S-records, use .s28 or .s37\n", size);
+         return -1;
+      }
+   }
+   w.file = image_create(filename, &piped);
+   if (!w.file)
+   {
+      fprintf(stderr, "Error: Failed to create '%s': %s\n", filename, strerror(errno));
+      return -1;
+   }
+   w.used = 0;
+   w.error = 0;
+   if (format == FORMAT_BINARY)
+   {
+      if (fwrite(data, 1, size, w.file) != (size_t)size) w.error = 1;
+   }
+   else
+   {
+      if (!hex_pairs[0][0]) init_hex_pairs();
+      if (format == FORMAT_IHEX)
+         write_ihex(&w, data, size);
+      else
+         write_srec(&w, data, size, addr_bytes);
+      flush_writer(&w);
+   }
+   if (image_close(w.file, piped) != 0 || w.error)
+   {
+      fprintf(stderr, "Error: Failed to write '%s'\n", filename);
+      return -1;
+   }
+   printf("%d bytes exported to %s\n", size, filename);
+   return 0;
+}
@@ -0,0 +1,82 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fuzz.h"
+
+// Throughput of the parsers over the corpus files given. Each file is
+// parsed repeatedly for a while, hex files with parse_ihex, S-records
+// with parse_srec, other files are skipped. With REFERENCE the reference
+// parsers are measured as well.
+
+#define MIN_TIME 0.2
+
+static double
+measure(enum Parser parser, bool reference, const uint8_t *data, size_t size)
+{
+   struct Decoded out;
+   double start = stats_now();
+   double elapsed;
+   long runs = 0;
+
+   do
+   {
+      decode(parser, reference, data, size, 0, false, &out);
+      runs++;
+      elapsed = stats_now() - start;
+   } while (elapsed < MIN_TIME);
+   return runs * size / elapsed / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+   double total_bytes = 0;
+   double total_time = 0;
+   int i;
+
+   decode_init();
+   for (i = 1; i < argc; i++)
+   {
+      enum ImageFormat format = image_format(argv[i]);
+      enum Parser parser = (format == FORMAT_IHEX) ? PARSE_IHEX : PARSE_SREC;
+      FILE *file;
+      uint8_t *data;
+      struct stat st;
+      double rate;
+
+      if (format != FORMAT_IHEX && format != FORMAT_SREC) continue;
+      file = fopen(argv[i], "rb");
+      if (!file || fstat(fileno(file), &st) < 0 || st.st_size == 0)
+      {
+         if (file) fclose(file);
+         continue;
+      }
+      data = malloc(st.st_size);
+      if (!data || fread(data, 1, st.st_size, file) != (size_t)st.st_size)
+      {
+         fprintf(report_err, "Error: Failed to read '%s': %s\n", argv[i], strerror(errno));
+         return EXIT_FAILURE;
+      }
+      fclose(file);
+      rate = measure(parser, false, data, st.st_size);
+      total_bytes += st.st_size;
+      total_time += st.st_size / (rate * 1e6);
+      fprintf(report_out, "%-28s %8ld bytes %8.1f MB/s", argv[i], (long)st.st_size, rate);
+#ifdef REFERENCE
+      {
+         double reference = measure(parser, true, data, st.st_size);
+
+         fprintf(report_out, ", reference %8.1f MB/s (%+.0f%%)", reference,
+               100 * (rate / reference - 1));
+      }
+#endif
+      fprintf(report_out, "\n");
+      free(data);
+   }
+   if (total_time > 0)
+      fprintf(report_out, "Total %.0f bytes, %.1f MB/s\n", total_bytes, total_bytes / total_time / 1e6);
+   return EXIT_SUCCESS;
+}
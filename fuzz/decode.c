@@ -0,0 +1,102 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fuzz.h"
+
+// Runs the parsers on a memory buffer. With REFERENCE the parsers of an
+// older revision are linked in as well, their symbols prefixed with ref_
+// by the Makefile, and run on the same input.
+
+#ifdef REFERENCE
+extern bool ref_offset_given;
+extern long ref_window_size;
+int ref_parse_ihex(FILE *file, uint8_t *buffer, long *min, long *max, long offset,
+      struct Coverage *coverage);
+int ref_parse_srec(FILE *file, uint8_t *buffer, long *min, long *max, long offset,
+      struct Coverage *coverage);
+#endif
+
+#define FILL 0xA5               // initial buffer contents, to see every write
+#define WINDOW (64 * 1024)      // small window, so inputs reach its limits easily
+
+FILE *report_out;
+FILE *report_err;
+
+// Buffers of exactly the window size, so the sanitizers catch overflows
+static uint8_t *mem[2];
+static uint8_t *map[2];
+
+void
+decode_init(void)
+{
+   int null;
+   int i;
+
+   if (mem[0]) return;
+   for (i = 0; i < 2; i++)
+   {
+      mem[i] = malloc(WINDOW);
+      map[i] = malloc(WINDOW);
+      if (!mem[i] || !map[i]) abort();
+   }
+   // Keep the original streams for reports. stderr can't be redirected
+   // on file descriptor level, fuzzers and sanitizers report through it.
+   report_out = fdopen(dup(STDOUT_FILENO), "w");
+   report_err = stderr;
+   null = open("/dev/null", O_WRONLY);
+   if (!report_out || null < 0) abort();
+   dup2(null, STDOUT_FILENO);
+   close(null);
+   stderr = fopen("/dev/null", "w");
+}
+
+int
+decode(enum Parser parser, bool reference, const uint8_t *data, size_t size,
+      long offset, bool offset_set, struct Decoded *out)
+{
+   FILE *file;
+
+   // fmemopen() rejects empty buffers
+   if (size == 0) return -1;
+   file = fmemopen((void *)data, size, "r");
+   if (!file) return -1;
+   out->mem = mem[reference];
+   out->coverage.map = map[reference];
+   out->coverage.base = 0;
+   out->coverage.ignored = 0;
+   out->min = 0;
+   out->max = 0;
+   memset(out->mem, FILL, WINDOW);
+   memset(out->coverage.map, 0, WINDOW);
+   if (!reference)
+   {
+      offset_given = offset_set;
+      window_size = WINDOW;
+      out->result = (parser == PARSE_IHEX ? parse_ihex : parse_srec)
+         (file, out->mem, &out->min, &out->max, offset, &out->coverage);
+   }
+   else
+   {
+#ifdef REFERENCE
+      ref_offset_given = offset_set;
+      ref_window_size = WINDOW;
+      out->result = (parser == PARSE_IHEX ? ref_parse_ihex : ref_parse_srec)
+         (file, out->mem, &out->min, &out->max, offset, &out->coverage);
+#else
+      abort();
+#endif
+   }
+   fclose(file);
+   return 0;
+}
+
+bool
+decoded_equal(const struct Decoded *a, const struct Decoded *b)
+{
+   return a->result == b->result && a->min == b->min && a->max == b->max &&
+      a->coverage.base == b->coverage.base && a->coverage.ignored == b->coverage.ignored &&
+      !memcmp(a->mem, b->mem, WINDOW) && !memcmp(a->coverage.map, b->coverage.map, WINDOW);
+}
@@ -0,0 +1,76 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fuzz.h"
+
+// main() for builds without libFuzzer: runs the fuzz target on each file
+// given, or on stdin for AFL.
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static uint8_t *
+read_all_of(FILE *file, size_t *size)
+{
+   uint8_t *data = NULL;
+   size_t capacity = 0;
+   size_t n;
+
+   *size = 0;
+   do
+   {
+      if (*size == capacity)
+      {
+         uint8_t *p;
+
+         capacity = capacity ? 2 * capacity : 65536;
+         p = realloc(data, capacity);
+         if (!p)
+         {
+            free(data);
+            return NULL;
+         }
+         data = p;
+      }
+      n = fread(data + *size, 1, capacity - *size, file);
+      *size += n;
+   } while (n > 0);
+   return data;
+}
+
+int
+main(int argc, char *argv[])
+{
+   uint8_t *data;
+   size_t size;
+   int i;
+
+   decode_init();
+   if (argc < 2)
+   {
+      data = read_all_of(stdin, &size);
+      if (!data) return EXIT_FAILURE;
+      LLVMFuzzerTestOneInput(data, size);
+      free(data);
+      return EXIT_SUCCESS;
+   }
+   for (i = 1; i < argc; i++)
+   {
+      FILE *file = fopen(argv[i], "rb");
+
+      fprintf(report_err, "Running: %s\n", argv[i]);
+      if (!file)
+      {
+         fprintf(report_err, "Error: Failed to open '%s': %s\n", argv[i], strerror(errno));
+         return EXIT_FAILURE;
+      }
+      data = read_all_of(file, &size);
+      fclose(file);
+      if (!data) return EXIT_FAILURE;
+      LLVMFuzzerTestOneInput(data, size);
+      free(data);
+   }
+   fprintf(report_out, "%d inputs passed\n", argc - 1);
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,32 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "memsim2.h"
+
+enum Parser { PARSE_IHEX, PARSE_SREC };
+
+// Everything a parser run leaves behind, compared in differential mode
+struct Decoded
+{
+   int result;
+   long min;
+   long max;
+   struct Coverage coverage;
+   uint8_t *mem;        // window of the parser
+};
+
+// Original stdout and stderr, the parsers' own output is discarded
+extern FILE *report_out;
+extern FILE *report_err;
+
+void decode_init(void);
+int decode(enum Parser parser, bool reference, const uint8_t *data, size_t size,
+      long offset, bool offset_set, struct Decoded *out);
+bool decoded_equal(const struct Decoded *a, const struct Decoded *b);
+
+#endif
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fuzz.h"
+
+// Fuzz target for libFuzzer, AFL (with driver.c) and corpus replay.
+// Every input is run through both parsers, with a floating window and
+// with a fixed offset. With REFERENCE the result of each run must match
+// the reference parsers byte for byte.
+
+static const struct
+{
+   long offset;
+   bool offset_set;
+} windows[] =
+{
+   { 0, false },        // window starts at the lowest address found
+   { 0x8000, true },    // window at -o 0x8000
+};
+
+static const char *parser_names[] = { "parse_ihex", "parse_srec" };
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+   struct Decoded current;
+   int parser;
+   unsigned int w;
+
+   decode_init();
+   for (parser = PARSE_IHEX; parser <= PARSE_SREC; parser++)
+   {
+      for (w = 0; w < sizeof(windows) / sizeof(windows[0]); w++)
+      {
+         if (decode(parser, false, data, size, windows[w].offset, windows[w].offset_set, &current) < 0)
+            return 0;
+#ifdef REFERENCE
+         {
+            struct Decoded reference;
+
+            decode(parser, true, data, size, windows[w].offset, windows[w].offset_set, &reference);
+            if (!decoded_equal(&current, &reference))
+            {
+               fprintf(report_err, "Differential: %s%s differs from reference: "
+                     "result %d/%d, min %lXh/%lXh, max %lXh/%lXh, ignored %ld/%ld\n",
+                     parser_names[parser], windows[w].offset_set ? " with offset" : "",
+                     current.result, reference.result, current.min, reference.min,
+                     current.max, reference.max, current.coverage.ignored,
+                     reference.coverage.ignored);
+               abort();
+            }
+         }
+#else
+         (void)parser_names;
+#endif
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,183 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memsim2.h"
+
+// Hotplug monitoring: wait for kernel uevents announcing a memSIM2 serial
+// device and send the last image again whenever it reappears. A tty
+// belongs to a memSIM2 if one of its parent devices in sysfs has the
+// product name MEMSIM2, the same attribute used by 62-memsim2.rules.
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#define OPEN_TIMEOUT 5.0        // seconds to wait for udev to set up the node
+
+static double
+now(void)
+{
+   struct timespec t;
+
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static bool
+is_memsim2(const char *devpath)
+{
+   char path[PATH_MAX];
+   char product[64];
+   char *slash;
+   FILE *file;
+
+   snprintf(path, sizeof(path), "/sys%s", devpath);
+   while ((slash = strrchr(path, '/')) && slash != path)
+   {
+      char attr[PATH_MAX + sizeof("/product")];
+
+      *slash = '\0';
+      snprintf(attr, sizeof(attr), "%s/product", path);
+      file = fopen(attr, "r");
+      if (!file) continue;
+      product[0] = '\0';
+      if (!fgets(product, sizeof(product), file)) product[0] = '\0';
+      fclose(file);
+      product[strcspn(product, "\r\n")] = '\0';
+      return strcmp(product, "MEMSIM2") == 0;
+   }
+   return false;
+}
+
+static const char *
+uevent_value(const char *msg, int len, const char *key)
+{
+   const char *p = msg;
+   size_t keylen = strlen(key);
+
+   while (p < msg + len)
+   {
+      if (!strncmp(p, key, keylen) && p[keylen] == '=') return p + keylen + 1;
+      p += strlen(p) + 1;
+   }
+   return NULL;
+}
+
+// Wait for a memSIM2 tty to be added, returns its device node in name
+static int
+wait_for_device(int sock, const char *device, char *name, size_t size)
+{
+   char msg[8192];
+
+   while (1)
+   {
+      const char *action, *subsystem, *devname, *devpath;
+      int len = recv(sock, msg, sizeof(msg) - 1, 0);
+
+      if (len < 0)
+      {
+         if (errno == EINTR) continue;
+         perror("Error: Failed to receive uevent");
+         return -1;
+      }
+      msg[len] = '\0';
+      action = uevent_value(msg, len, "ACTION");
+      subsystem = uevent_value(msg, len, "SUBSYSTEM");
+      devname = uevent_value(msg, len, "DEVNAME");
+      devpath = uevent_value(msg, len, "DEVPATH");
+      if (!action || !subsystem || !devname || !devpath) continue;
+      if (strcmp(subsystem, "tty")) continue;
+
+      snprintf(name, size, "/dev/%s", devname);
+      if (!is_memsim2(devpath) && (!device || strcmp(device, name))) continue;
+      if (!strcmp(action, "remove"))
+         printf("%s removed\n", name);
+      else if (!strcmp(action, "add"))
+         return 0;
+   }
+}
+
+static int
+reattach(const char *name, const struct EmuConfig *config, uint8_t *mem, int sim_size)
+{
+   double start = now();
+   double cpu = stats_cpu();
+   int fd = -1;
+   int res;
+
+   memset(&stats, 0, sizeof(stats));
+   // The node shows up before udev has applied permissions
+   while (access(name, R_OK | W_OK) < 0 || (fd = serial_open(name)) < 0)
+   {
+      if (now() - start > OPEN_TIMEOUT)
+      {
+         fprintf(stderr, "Error: %s did not become accessible\n", name);
+         return -1;
+      }
+      usleep(20 * 1000);
+   }
+   res = send_image(fd, config, mem, sim_size);
+   close(fd);
+   stats.cpu = stats_cpu() - cpu;
+   stats_record(&stats, name, config->mem_type->name, sim_size, res == 0);
+   if (res == 0)
+      printf("%s ready %.3f s after plug-in\n", name, now() - start);
+   return res;
+}
+
+int
+hotplug_watch(const char *device, const struct EmuConfig *config, uint8_t *mem, int sim_size)
+{
+   struct sockaddr_nl addr;
+   char name[PATH_MAX];
+   int sock;
+
+   sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+   if (sock < 0)
+   {
+      perror("Error: Failed to open uevent socket");
+      return -1;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.nl_family = AF_NETLINK;
+   addr.nl_pid = 0;
+   addr.nl_groups = 1;          // kernel events
+   if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+   {
+      perror("Error: Failed to bind uevent socket");
+      close(sock);
+      return -1;
+   }
+   printf("Waiting for memSIM2 devices, press Ctrl-C to quit\n");
+   fflush(stdout);
+   while (wait_for_device(sock, device, name, sizeof(name)) == 0)
+   {
+      printf("%s added\n", name);
+      reattach(name, config, mem, sim_size);
+      fflush(stdout);
+   }
+   close(sock);
+   return -1;
+}
+
+#else
+
+int
+hotplug_watch(const char *device, const struct EmuConfig *config, uint8_t *mem, int sim_size)
+{
+   (void) device;
+   (void) config;
+   (void) mem;
+   (void) sim_size;
+   fprintf(stderr, "Error: hotplug monitoring is only supported on Linux\n");
+   return -1;
+}
+
+#endif
@@ -0,0 +1,203 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "memsim2.h"
+
+// Byte lane splitting for 16 and 32 bit buses built from 8 bit EPROMs.
+// Lane n receives all bytes at addresses n, n + lanes, n + 2 * lanes, ...
+// For a big endian 68000 bus, lane 0 is the high byte (D15-D8).
+
+#if defined(__SSE2__)
+static size_t
+deinterleave_sse2(const uint8_t *src, size_t count, uint8_t **lane, int lanes)
+{
+   const __m128i lo = _mm_set1_epi16(0x00FF);
+   size_t i = 0;
+
+   if (lanes == 2)
+   {
+      for (; i + 32 <= count; i += 32)
+      {
+         __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+         __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+         __m128i even = _mm_packus_epi16(_mm_and_si128(a, lo), _mm_and_si128(b, lo));
+         __m128i odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+         _mm_storeu_si128((__m128i *)(lane[0] + i / 2), even);
+         _mm_storeu_si128((__m128i *)(lane[1] + i / 2), odd);
+      }
+   }
+   else if (lanes == 4)
+   {
+      for (; i + 64 <= count; i += 64)
+      {
+         __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+         __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+         __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+         __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+         // First pass: bytes 0, 2 (even) and 1, 3 (odd) of each word
+         __m128i e0 = _mm_packus_epi16(_mm_and_si128(a, lo), _mm_and_si128(b, lo));
+         __m128i e1 = _mm_packus_epi16(_mm_and_si128(c, lo), _mm_and_si128(d, lo));
+         __m128i o0 = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+         __m128i o1 = _mm_packus_epi16(_mm_srli_epi16(c, 8), _mm_srli_epi16(d, 8));
+         // Second pass splits them again into the four lanes
+         _mm_storeu_si128((__m128i *)(lane[0] + i / 4),
+               _mm_packus_epi16(_mm_and_si128(e0, lo), _mm_and_si128(e1, lo)));
+         _mm_storeu_si128((__m128i *)(lane[2] + i / 4),
+               _mm_packus_epi16(_mm_srli_epi16(e0, 8), _mm_srli_epi16(e1, 8)));
+         _mm_storeu_si128((__m128i *)(lane[1] + i / 4),
+               _mm_packus_epi16(_mm_and_si128(o0, lo), _mm_and_si128(o1, lo)));
+         _mm_storeu_si128((__m128i *)(lane[3] + i / 4),
+               _mm_packus_epi16(_mm_srli_epi16(o0, 8), _mm_srli_epi16(o1, 8)));
+      }
+   }
+   return i;
+}
+#endif
+
+void
+deinterleave(const uint8_t *src, size_t count, uint8_t **lane, int lanes)
+{
+   size_t i = 0;
+
+#if defined(__SSE2__)
+   i = deinterleave_sse2(src, count, lane, lanes);
+#endif
+   for (; i < count; i++)
+      lane[i % lanes][i / lanes] = src[i];
+}
+
+static double
+seconds_since(const struct timespec *start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double
+thread_cpu(void)
+{
+   struct timespec t;
+
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void *
+upload_job(void *arg)
+{
+   struct UploadJob *job = arg;
+   struct UploadStats saved = stats;    // if run by the caller's thread
+   struct timespec start;
+   double cpu = thread_cpu();
+   double opened;
+   int sim_size = job->size;
+   int fd;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   memset(&stats, 0, sizeof(stats));
+   job->result = -1;
+   opened = stats_now();
+   fd = serial_open(job->device);
+   stats_phase(PHASE_OPEN, opened);
+   if (fd >= 0)
+   {
+      if (memsim_config(fd, &job->config) == 0)
+      {
+         int divider = mirror_small_image(job->data, job->config.mem_type, &sim_size);
+
+         job->result = memsim_upload(fd, job->data, sim_size, false, divider);
+      }
+      close(fd);
+   }
+   job->seconds = seconds_since(&start);
+   stats.cpu = thread_cpu() - cpu;
+   job->stats = stats;
+   stats = saved;
+   return NULL;
+}
+
+// Upload several images to several devices at the same time, one thread
+// per device. Every job's data buffer must hold at least 8 KB for
+// mirroring of 2716 and 2732 images.
+int
+upload_parallel(struct UploadJob *jobs, int count)
+{
+   pthread_t thread[MAX_DEVICES];
+   bool started[MAX_DEVICES];
+   struct timespec start;
+   int failed = 0;
+   int i;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (i = 0; i < count; i++)
+   {
+      started[i] = pthread_create(&thread[i], NULL, upload_job, &jobs[i]) == 0;
+      if (!started[i]) upload_job(&jobs[i]);
+   }
+   for (i = 0; i < count; i++)
+   {
+      if (started[i]) pthread_join(thread[i], NULL);
+      // Totals of all devices for the caller
+      stats.syscalls += jobs[i].stats.syscalls;
+      stats.timeouts += jobs[i].stats.timeouts;
+      stats_record(&jobs[i].stats, jobs[i].device, jobs[i].config.mem_type->name, jobs[i].size,
+            jobs[i].result >= 0);
+      if (jobs[i].result < 0)
+      {
+         fprintf(stderr, "Error: upload to %s failed\n", jobs[i].device);
+         failed++;
+      }
+      else
+         printf("%s: %d bytes (%s) in %.2f s\n", jobs[i].device, jobs[i].size,
+               jobs[i].config.mem_type->name, jobs[i].seconds);
+   }
+   printf("%d devices in %.2f s\n", count, seconds_since(&start));
+   return failed ? -1 : 0;
+}
+
+int
+upload_lanes(const uint8_t *mem, int image_size, int lanes, char **devices,
+      const struct EmuConfig *config)
+{
+   struct UploadJob jobs[MAX_LANES];
+   uint8_t *lane[MAX_LANES];
+   int lane_size = (image_size + lanes - 1) / lanes;
+   int res = -1;
+   int i;
+
+   for (i = 0; i < lanes; i++)
+   {
+      lane[i] = calloc(SIMMEMSIZE, 1);
+      if (!lane[i])
+      {
+         perror("Error: Failed to allocate lane buffer");
+         while (i--) free(lane[i]);
+         return -1;
+      }
+   }
+   deinterleave(mem, (size_t)lane_size * lanes, lane, lanes);
+   for (i = 0; i < lanes; i++)
+   {
+      if (scramble_apply(lane[i], config->mem_type->size) < 0) goto out;
+      jobs[i].device = devices[i];
+      jobs[i].config = *config;
+      jobs[i].data = lane[i];
+      jobs[i].size = config->mem_type->size;
+      printf("Lane %d: %d bytes to %s\n", i, lane_size, devices[i]);
+   }
+   res = upload_parallel(jobs, lanes);
+out:
+   for (i = 0; i < lanes; i++) free(lane[i]);
+   return res;
+}
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE             // F_GET_SEALS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memsim2.h"
+
+// Images passed by a build tool in an inherited file descriptor, e.g. a
+// memfd, with --fd. The descriptor is mapped read-only and the parsers
+// read from the mapping. A binary of exactly one chip that needs no
+// transformation is sent directly from the mapping, without a copy to
+// the image buffer. Descriptors that can't be mapped, like pipes, are
+// read as a stream.
+
+static struct
+{
+   int fd;
+   const uint8_t *data;         // NULL if not mapped
+   size_t size;
+   char name[32];               // stands for the image in place of a file name
+} attached = { -1, NULL, 0, "" };
+
+// Attach descriptor fd holding an image in format (hex, srec, bin or NULL
+// to detect it). Returns the name to pass as file name or NULL on error.
+const char *
+memfd_attach(int fd, const char *format)
+{
+   struct stat st;
+
+   if (format && strcmp(format, "hex") && strcmp(format, "srec") && strcmp(format, "bin"))
+   {
+      fprintf(stderr, "Error: Unknown image format '%s', use hex, srec or bin\n", format);
+      return NULL;
+   }
+   if (fstat(fd, &st) < 0)
+   {
+      fprintf(stderr, "Error: Bad file descriptor %d: %s\n", fd, strerror(errno));
+      return NULL;
+   }
+   attached.fd = fd;
+   // The suffix selects the parser like for files
+   snprintf(attached.name, sizeof(attached.name), "fd %d%s%s", fd, format ? "." : "",
+         format ? format : "");
+   if (!S_ISREG(st.st_mode) || st.st_size == 0) return attached.name;
+   attached.data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (attached.data == MAP_FAILED)
+   {
+      attached.data = NULL;
+      return attached.name;
+   }
+   attached.size = st.st_size;
+#ifdef F_GET_SEALS
+   {
+      int seals = fcntl(fd, F_GET_SEALS);
+
+      if (seals >= 0 && !(seals & F_SEAL_WRITE))
+         printf("Info: fd %d is not sealed, it must not change during the upload\n", fd);
+   }
+#endif
+   return attached.name;
+}
+
+// True if filename is the name returned by memfd_attach()
+bool
+memfd_is(const char *filename)
+{
+   return filename == attached.name;
+}
+
+FILE *
+memfd_open(void)
+{
+   int fd;
+   FILE *file;
+
+   if (attached.data) return fmemopen((void *)attached.data, attached.size, "r");
+   // Streams are closed with fclose(), which must not close the original
+   fd = dup(attached.fd);
+   if (fd < 0) return NULL;
+   file = fdopen(fd, "rb");
+   if (!file) close(fd);
+   return file;
+}
+
+// The mapped image if it can be sent as it is: a binary of exactly the
+// size of a chip, which is sent without mirroring or padding.
+// mem_type and sim_size are set like by select_mem_type().
+const uint8_t *
+memfd_direct(const struct MemType **mem_type, int *sim_size)
+{
+   struct ChipPlan plan;
+
+   if (!attached.data || image_format(attached.name) != FORMAT_BINARY || offset_given) return NULL;
+   if (scramble_active() || checksum_active() || attached.size > SIMMEMSIZE) return NULL;
+   if (chip_plan(mem_type_given ? *mem_type : NULL, attached.size, &plan) < 0) return NULL;
+   if (plan.image_size != plan.sim_size || plan.send_size != plan.sim_size) return NULL;
+   *mem_type = select_mem_type(*mem_type, plan.image_size, sim_size);
+   printf("Info: sending %d bytes directly from fd %d\n", *sim_size, attached.fd);
+   return attached.data;
+}
+
+// Configure the simulator and upload the mapped image of memfd_direct()
+int
+memfd_send(int fd, const struct EmuConfig *config, const uint8_t *data, int sim_size)
+{
+   if (memsim_config(fd, config) < 0) return -1;
+   if (memsim_upload(fd, data, sim_size, true, 1) < 0) return -1;
+   printf("\n");
+   return 0;
+}
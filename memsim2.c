@@ -12,6 +12,8 @@
 #include <limits.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
 
 #include "memsim2.h"
 
@@ -26,6 +28,8 @@
 // Global variables
 bool mem_type_given = false;
 bool offset_given = false;
+long window_size = SIMMEMSIZE;
+bool use_uring = false;
 static uint8_t mem[SIMMEMSIZE];
 #define MEM_TYPE_INDEX          2
 #define RESET_ENABLE_INDEX      3
@@ -37,26 +41,6 @@ static uint8_t mem[SIMMEMSIZE];
 
 char device_name[MAX_STR];
 
-struct MemType
-{
-   const char *name;
-   char cmd;
-   int size;
-};
-
-const struct MemType memory_types[] =
-{
-   { "2716",  '0',   2 * 1024 },
-   { "2732",  '0',   4 * 1024 },
-   { "2764",  '0',   8 * 1024 },
-   { "27128", '1',  16 * 1024 },
-   { "27256", '2',  32 * 1024 },
-   { "27512", '3',  64 * 1024 },
-   { "27010", '4', 128 * 1024 },
-   { "27020", '5', 256 * 1024 },
-   { "27040", '6', 512 * 1024 }
-};
-
 // **********
 // StrCaseStr
 // **********
@@ -104,7 +88,7 @@ int detect_device(void)
    return -1;
 }
 
-static int
+int
 serial_open(const char *device)
 {
    struct termios settings;
@@ -142,20 +126,95 @@ serial_open(const char *device)
    return fd;
 }
 
+enum
+{
+   OPT_CHECK = 256,
+   OPT_JOBS,
+   OPT_REPORT,
+   OPT_CHIPS,
+   OPT_SHADOW,
+   OPT_URING,
+   OPT_REALTIME,
+   OPT_CPU,
+   OPT_STALLS,
+   OPT_BANKS,
+   OPT_DIAG,
+   OPT_FD,
+   OPT_FORMAT,
+};
+
+static const struct option long_options[] =
+{
+   { "check", no_argument, NULL, OPT_CHECK },
+   { "jobs", required_argument, NULL, OPT_JOBS },
+   { "report", no_argument, NULL, OPT_REPORT },
+   { "chips", required_argument, NULL, OPT_CHIPS },
+   { "shadow", optional_argument, NULL, OPT_SHADOW },
+   { "uring", no_argument, NULL, OPT_URING },
+   { "realtime", optional_argument, NULL, OPT_REALTIME },
+   { "cpu", required_argument, NULL, OPT_CPU },
+   { "stalls", no_argument, NULL, OPT_STALLS },
+   { "banks", no_argument, NULL, OPT_BANKS },
+   { "diag", optional_argument, NULL, OPT_DIAG },
+   { "fd", required_argument, NULL, OPT_FD },
+   { "format", required_argument, NULL, OPT_FORMAT },
+   { "help", no_argument, NULL, 'h' },
+   { NULL, 0, NULL, 0 }
+};
+
 static void
 usage(void)
 {
    fputs("Usage: [OPTION].. FILE\n"
+         "       --check [OPTION].. FILE..\n"
          "Upload image file to memSIM2 EPROM emulator\n\n"
          "Options:\n"
          "\t-d DEVICE     Serial device, defaults to " UDEV_DEVICE "\n"
+         "\t              Give once per device for byte lanes or banks.\n"
          "\t-m MEMTYPE    Memory type (2716 - 2K, 2732 - 4K, 2764 - 8K, 27128 - 16K, 27256 - 32K,\n"
          "\t              27512 - 64K, 27010 - 128K, 27020 - 256K, 27040 - 512K)\n"
          "\t              2716-2732 are 24 pin, 2764-27512 are 28 pin, 27010-27040 are 32 pin.\n"
          "\t              If no memory type is given, it is assumed by the image size.\n"
+         "\t--chips FILE  Load additional chip types from FILE\n"
          "\t-r RESETTIME  Time of reset pulse in milliseconds.\n"
          "\t              > 0 for positive pulse, < 0 for negative pulse\n"
          "\t-e            Enable emulation\n"
+         "\t-p            Pipelined mode: start transfer while the image is still parsed.\n"
+         "\t              Requires -m, hex files also require -o.\n"
+         "\t-l LANES      Split image into 2 or 4 byte lanes for 16 or 32 bit buses,\n"
+         "\t              uploaded concurrently to one device per lane given with -d.\n"
+         "\t              MEMTYPE and RESETTIME apply to each lane.\n"
+         "\t--banks       Split a large image into consecutive banks of MEMTYPE, or 512K,\n"
+         "\t              uploaded concurrently to one device per bank given with -d.\n"
+         "\t-b PROFILE    Board profile with address and data line scrambling\n"
+         "\t-s SCRIPT     Batch mode: run commands of SCRIPT with the device held open\n"
+         "\t-w            Keep running and upload the image again whenever the device\n"
+         "\t              is plugged in (Linux only)\n"
+         "\t-H FILE       Append a record of the upload to history log FILE\n"
+         "\t-M FILE       Update Prometheus textfile collector metrics in FILE\n"
+         "\t--shadow[=DIR] Remember the image sent to each device in DIR, defaults to\n"
+         "\t              ~/.cache/memsim2. Unchanged images are not sent again.\n"
+         "\t--uring       Send the image with io_uring in a few system calls (make URING=y)\n"
+         "\t--realtime[=fifo|rr]\n"
+         "\t              Transfer with real-time scheduling, or a lower nice value if that\n"
+         "\t              isn't permitted, and with the image locked in memory\n"
+         "\t--cpu N       Pin the transfer to CPU N\n"
+         "\t--stalls      Print percentiles of the duration of write() calls\n"
+         "\t--diag[=N]    Measure N handshake round trips (default 100) and the throughput.\n"
+         "\t              Overwrites the simulated memory.\n"
+         "\t--fd N        Read the image from inherited file descriptor N instead of a file\n"
+         "\t--format FMT  Format of the image from --fd: hex, srec or bin\n"
+         "\t-C TRACE      Capture all serial traffic with timestamps to TRACE\n"
+         "\t-R TRACE      Replay TRACE: act as simulator on a pseudo terminal\n"
+         "\t-F            Replay as fast as possible instead of with original timing\n"
+         "\t-x FILE       Export the image as it would be sent to FILE instead of uploading,\n"
+         "\t              format by suffix: .bin, .hex or .s19/.s28\n"
+         "\t-c CHECKSUM   Compute a checksum and optionally store it in the image:\n"
+         "\t              sum8|sum16|crc16|crc32[:START-END][@ADDRESS[,le|be]]\n"
+         "\t--report      Print the checksums of the image and exit without uploading\n"
+         "\t--check       Only parse the files and report ranges, holes and chip type.\n"
+         "\t              Exit status 1 for parse errors, 2 for size mismatches, 3 for both.\n"
+         "\t--jobs N      Number of threads for --check, defaults to number of CPUs\n"
          "\t-o BYTES      Specify an offset value with different meaning for:\n"
          "\t              binary files: skip first n bytes of file\n"
          "\t              Hex files: start address in memory map of simulated memory chip\n"
@@ -167,56 +226,110 @@ usage(void)
 }
 
 
+// Files are read sequentially, so compressed files can be read from a pipe
 static int
-read_binary(FILE *file, uint8_t *mem, int file_offset)
+read_binary(FILE *file, uint8_t *mem, long file_offset, struct Coverage *coverage)
 {
-   int res;
-   unsigned long addr = 0;
-   int mem_size = SIMMEMSIZE;
-   fseek(file, 0L, SEEK_END);
-   long detected_binary_size = ftell(file);
+   uint8_t scratch[4096];
+   long start = 0;
+   long addr;
+   long beyond = 0;
+   long pos;
+   struct stat st;
+   size_t res;
 
-   if (detected_binary_size > SIMMEMSIZE)
-   {
-      fprintf(stderr, "Error: file too large\n");
-      return -1;
-   }
    if (file_offset > 0)
    {
-      res = fseek(file, file_offset, SEEK_SET);
-      if (res < 0)
+      // Pipes can't seek, skip by reading
+      if (fseek(file, file_offset, SEEK_SET) < 0)
       {
-         perror("Error: Failed to seek to file_offset in binary file");
-         return -1;
+         long skip = file_offset;
+
+         while (skip > 0 && (res = fread(scratch, 1, (skip < 4096) ? skip : 4096, file)) > 0)
+            skip -= res;
       }
    }
    else
+      start = -file_offset;
+   if (start >= window_size)
    {
-      rewind(file);
-      addr = -file_offset;
+      fprintf(stderr,"Error: Offset outside memory\n");
+      return -1;
    }
-   if (addr >= SIMMEMSIZE)
+   addr = start;
+   while (addr < window_size)
    {
-      fprintf(stderr,"Error: Offset outside memory");
-      return -1;
+      long portion = (window_size - addr < 4096) ? window_size - addr : 4096;
+
+      res = fread(mem + addr, sizeof(uint8_t), portion, file);
+      if (res == 0) break;
+      addr += res;
+      stream_record(addr);
    }
-   mem_size -= addr;
-   res = fread(mem + addr, sizeof(uint8_t), mem_size, file);
-   if (res < 0)
+   // Count data that doesn't fit into memory, only pipes need to be read
+   if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && (pos = ftell(file)) >= 0)
+      beyond = (st.st_size > pos) ? st.st_size - pos : 0;
+   else
+      while ((res = fread(scratch, 1, sizeof(scratch), file)) > 0)
+         beyond += res;
+   if (ferror(file))
    {
       perror("Error: Failed to read from binary file");
       return -1;
    }
+   if (addr == start && file_offset > 0)
+   {
+      fprintf(stderr, "Error: Offset beyond end of file\n");
+      return -1;
+   }
+   if (coverage)
+   {
+      coverage->base = 0;
+      coverage->ignored = beyond;
+      memset(coverage->map + start, 1, addr - start);
+   }
+   if (beyond)
+   {
+      if (!mem_type_given)
+      {
+         fprintf(stderr, "Error: file too large, specify a memory type to extract a part of it\n");
+         return -1;
+      }
+      printf("Info: %ld bytes beyond end of memory ignored\n", beyond);
+   }
+   return addr - start;
+}
 
-   return detected_binary_size;
+enum ImageFormat
+image_format(const char *filename)
+{
+   // Format of compressed files is given by the suffix before, e.g. .hex.gz
+   size_t len = strlen(filename) - compressed_suffix(filename);
+   const char *dot = filename + len;
+   char suffix[8];
+
+   while (dot > filename && *--dot != '.');
+   if (*dot != '.') return FORMAT_NONE;
+   snprintf(suffix, sizeof(suffix), "%.*s", (int)(filename + len - dot - 1), dot + 1);
+   if (!strcasecmp(suffix, "HEX")) return FORMAT_IHEX;
+   if (!strcasecmp(suffix, "S19")  || !strcasecmp(suffix, "S28")  ||
+       !strcasecmp(suffix, "S37")  || !strcasecmp(suffix, "SREC") ||
+       !strcasecmp(suffix, "MOT"))
+      return FORMAT_SREC;
+   if (!strcasecmp(suffix, "BIN") || !strcasecmp(suffix, "ROM"))
+      return FORMAT_BINARY;
+   return FORMAT_UNKNOWN;
 }
 
-static int
-read_image(const char *filename, uint8_t *mem, int offset, int *min, int *max)
+int
+read_image(const char *filename, uint8_t *mem, long offset, long *min, long *max,
+      struct Coverage *coverage)
 {
    int detected_binary_size;
-   char *suffix;
-   FILE *file = fopen(filename, "rb");
+   enum ImageFormat format = image_format(filename);
+   bool piped;
+   FILE *file = image_open(filename, &piped);
+   FILE *stream = file;
 
    if (!file)
    {
@@ -224,48 +337,50 @@ read_image(const char *filename, uint8_t *mem, int offset, int *min, int *max)
             filename, strerror(errno));
       return -1;
    }
-   suffix = rindex(filename,'.');
-   if (!suffix)
-   {
-      fprintf(stderr, "Error: Filename has no suffix\n");
-      fclose(file);
-      return -1;
-   }
-   suffix++;
-   if (strcasecmp(suffix, "HEX") == 0)
+   if (format == FORMAT_NONE || format == FORMAT_UNKNOWN)
    {
-      if ((detected_binary_size = parse_ihex(file, mem, min, max, offset)) < 0)
+      // Detect the format from the first block, which is passed on to
+      // the parser, so it works for pipes as well
+      uint8_t block[SNIFF_SIZE];
+      size_t size = fread(block, 1, sizeof(block), file);
+      static const char *names[] =
       {
-         fclose(file);
+         [FORMAT_IHEX] = "Intel hex", [FORMAT_SREC] = "S-record", [FORMAT_BINARY] = "binary"
+      };
+
+      format = sniff_format(block, size);
+      if (format == FORMAT_ELF)
+      {
+         fprintf(stderr, "Error: ELF files are not supported, convert with objcopy -O binary or -O ihex\n");
+         image_close(file, piped);
          return -1;
       }
-   }
-   else if (!strcasecmp(suffix, "S19")  || !strcasecmp(suffix, "S28")  ||
-            !strcasecmp(suffix, "S37")  || !strcasecmp(suffix, "SREC") ||
-            !strcasecmp(suffix, "MOT"))
-   {
-      if ((detected_binary_size = parse_srec(file, mem, min, max, offset)) < 0)
+      printf("Info: no known suffix, content looks like %s\n", names[format]);
+      stream = prefix_file(file, block, size);
+      if (!stream)
       {
-         fclose(file);
+         image_close(file, piped);
          return -1;
       }
    }
-   else if (!strcasecmp(suffix, "BIN") || !strcasecmp(suffix, "ROM"))
+   switch (format)
    {
-      if ((detected_binary_size = read_binary(file, mem, offset)) < 0)
-      {
-         fclose(file);
-         return -1;
-      }
+      case FORMAT_IHEX:
+         detected_binary_size = parse_ihex(stream, mem, min, max, offset, coverage);
+         break;
+      case FORMAT_SREC:
+         detected_binary_size = parse_srec(stream, mem, min, max, offset, coverage);
+         break;
+      default:
+         detected_binary_size = read_binary(stream, mem, offset, coverage);
    }
-   else
+   if (stream != file) fclose(stream);
+   if (image_close(file, piped) < 0 && detected_binary_size >= 0)
    {
-      fprintf(stderr, "Error: Unknown suffix (no .hex or .bin)\n");
-      fclose(file);
+      fprintf(stderr, "Error: Failed to decompress '%s'\n", filename);
       return -1;
    }
-   fclose(file);
-   return detected_binary_size;
+   return detected_binary_size < 0 ? -1 : detected_binary_size;
 }
 
 
@@ -284,11 +399,12 @@ print_progress(size_t position, size_t endpos)
    fflush(stdout);
 }
 
-static int
+int
 write_all(int fd, const uint8_t *data, size_t count, int progress, int divider)
 {
    size_t full = count;
    size_t portion = 512;
+   double start;
    int w;
    size_t written = 0;
 
@@ -296,13 +412,17 @@ write_all(int fd, const uint8_t *data, size_t count, int progress, int divider)
    {
       if (progress) print_progress(written/divider, full/divider);
       portion = (count < 512) ? count : 512;
+      start = stats_now();
       w = write(fd, data, portion);
+      stats_syscalls(1);
+      stalls_record(stats_now() - start);
       /* fprintf(stderr, "Wrote %d\n", w); */
       if (w < 0)
       {
          printf("\n");
          return w;
       }
+      capture_record('W', data, w);
       data += w;
       written += w;
       count -= w;
@@ -387,7 +507,7 @@ dump_sim_mem(const uint8_t *data, size_t count)
 #endif
 
 
-static int
+int
 read_all(int fd, uint8_t *data, size_t count, int timeout)
 {
    struct pollfd fds;
@@ -399,9 +519,12 @@ read_all(int fd, uint8_t *data, size_t count, int timeout)
    {
       int r;
       r = poll(&fds, 1, timeout);
+      stats_syscalls(1);
       if (r <= 0) return 0;
       r = read(fd, data, count);
+      stats_syscalls(1);
       if (r <= 0) return r;
+      capture_record('R', data, r);
       count -= r;
       data += r;
    }
@@ -464,7 +587,7 @@ get_hex(FILE *file)                             // nibble
    ch = getc(file);
    if (ch >= '0' && ch <= '9') return ch - '0';
    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
-   if (ch >= 'a' && ch <= 'a') return ch - 'a' + 10;
+   if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
    ungetc(ch, file);
    return -1;
 }
@@ -520,6 +643,302 @@ get_hex8(FILE *file, int *check)                // 32 bit
    return v1 * 65536 + v2;
 }
 
+// Skip count bytes of hex data without storing them, they are only
+// added to check for the record's checksum
+int
+skip_hex(FILE *file, int count, int *check)
+{
+   while (count-- > 0)
+      if (get_hex2(file, check) < 0) return -1;
+   return 0;
+}
+
+// The image buffer holds window_size bytes starting at the offset given
+// with -o. Without offset the window starts at the lowest address found
+// and moves down if a record below the current start still fits into it.
+void
+window_init(struct Window *window, long offset, struct Coverage *coverage)
+{
+   window->base = offset;
+   window->end = offset;
+   window->anchored = offset_given;
+   window->coverage = coverage;
+}
+
+// Returns the buffer index for addr, which is outside the buffer if the
+// record doesn't fit into the window
+long
+window_index(struct Window *window, uint8_t *buffer, long addr, int length)
+{
+   long limit;
+
+   // Records without data neither place nor move the window, index 0
+   // makes the caller skip them
+   if (length == 0) return 0;
+   if (!window->anchored)
+   {
+      window->base = addr;
+      window->end = addr;
+      window->anchored = true;
+   }
+   else if (!offset_given && addr < window->base && window->end - addr <= window_size)
+   {
+      long shift = window->base - addr;
+
+      memmove(buffer + shift, buffer, window->end - window->base);
+      memset(buffer, 0, shift);
+      if (window->coverage)
+      {
+         uint8_t *map = window->coverage->map;
+
+         memmove(map + shift, map, window->end - window->base);
+         memset(map, 0, shift);
+      }
+      window->base = addr;
+   }
+   limit = window->base + window_size;
+   if (addr + length > window->end)
+      window->end = (addr + length < limit) ? addr + length : limit;
+   return addr - window->base;
+}
+
+
+int
+open_device(const char *device)
+{
+   int fd;
+
+   snprintf(device_name, sizeof(device_name), "%s", device == NULL ? UDEV_DEVICE : device);
+   fd = serial_open(device_name);
+   if (fd < 0)
+   {
+      printf("Looking for MEMSIM2 device");
+      if (detect_device())
+      {
+         fd = serial_open(device_name);
+         printf(": found %s\n", device_name);
+      } else {
+         printf(": not found\n");
+      }
+   }
+
+   if (fd < 0)
+   {
+      printf("Trying default device: %s\n", DEFAULT_DEVICE);
+      strcpy(device_name, DEFAULT_DEVICE);
+      fd = serial_open(DEFAULT_DEVICE);
+   }
+   return fd;
+}
+
+// Check a reply of res bytes, res is 0 after a timeout
+static int
+check_reply(const char *emu_cmd, char *emu_reply, int res, const char *what)
+{
+   if (res == 0)
+   {
+      fprintf(stderr, "Error: Timeout while waiting for %s reply\n", what);
+      stats.timeouts++;
+      return -1;
+   }
+   if (res != 16)
+   {
+      fprintf(stderr, "Error: Failed to read %s reply: %s\n", what, strerror(errno));
+      return -1;
+   }
+   emu_reply[16] = '\0';
+   debug_printf("Reply: %s\n", emu_reply);
+   if (memcmp(emu_cmd, emu_reply, 8) != 0)
+   {
+      fprintf(stderr, "Error: Response didn't match command\n");
+      return -1;
+   }
+   return 0;
+}
+
+static int
+read_reply(int fd, const char *emu_cmd, int timeout, const char *what)
+{
+   char emu_reply[16+1];
+   int res;
+
+   res = read_all(fd, (uint8_t*)emu_reply, 16, timeout);
+   return check_reply(emu_cmd, emu_reply, res, what);
+}
+
+// Format the configuration command, emu_cmd has MEMSIM_CMD_SIZE bytes
+void
+memsim_config_cmd(const struct EmuConfig *config, char *emu_cmd)
+{
+   snprintf(emu_cmd, MEMSIM_CMD_SIZE, "MC%c%c%03u%c%c00023\r\n",
+         config->mem_type->cmd, config->reset_enable, (uint8_t)config->reset_time,
+         config->emu_enable, config->selftest);
+}
+
+int
+memsim_config(int fd, const struct EmuConfig *config)
+{
+   char emu_cmd[MEMSIM_CMD_SIZE];
+   double start = stats_now();
+   int res;
+
+   memsim_config_cmd(config, emu_cmd);
+
+   debug_printf("Config: %s\n", emu_cmd);
+   res = write_all(fd, (uint8_t*)emu_cmd, sizeof(emu_cmd) - 1, 0, 0);
+   if (res != sizeof(emu_cmd) - 1) {
+      perror("Failed to write configuration");
+   }
+   res = read_reply(fd, emu_cmd, 5000, "configuration");
+   stats_phase(PHASE_CONFIG, start);
+   return res;
+}
+
+static void
+memsim_data_cmd(int sim_size, char *emu_cmd)
+{
+   snprintf(emu_cmd, MEMSIM_CMD_SIZE, "MD%04d00000058\r\n", sim_size / 1024 % 1000);
+}
+
+int
+memsim_data_begin(int fd, int sim_size, char *emu_cmd)
+{
+   int res;
+
+   memsim_data_cmd(sim_size, emu_cmd);
+   debug_printf("Data: %s\n", emu_cmd);
+   res = write_all(fd, (uint8_t*)emu_cmd, MEMSIM_CMD_SIZE - 1, 0, 0);
+   if (res != MEMSIM_CMD_SIZE - 1)
+   {
+      perror("Error: Failed to write data header");
+      return -1;
+   }
+   return 0;
+}
+
+int
+memsim_data_end(int fd, const char *emu_cmd)
+{
+   double start = stats_now();
+   int res;
+
+   res = read_reply(fd, emu_cmd, 15000, "data");
+   stats_phase(PHASE_REPLY, start);
+   return res;
+}
+
+int
+memsim_upload(int fd, const uint8_t *data, int sim_size, bool progress, int divider)
+{
+   char emu_cmd[MEMSIM_CMD_SIZE];
+   char emu_reply[MEMSIM_CMD_SIZE];
+   double start = stats_now();
+   static __thread bool uring_failed;   // use_uring is shared by the lane threads
+   int res;
+
+   if (use_uring && !uring_failed)
+   {
+      memsim_data_cmd(sim_size, emu_cmd);
+      res = uring_upload(fd, emu_cmd, data, sim_size, emu_reply, 15000, progress, divider);
+      if (res != URING_UNAVAILABLE)
+      {
+         if (res < 0)
+         {
+            perror("Error: Failed to write data");
+            return -1;
+         }
+         dump_sim_mem(data, sim_size);
+         return check_reply(emu_cmd, emu_reply, res, "data");
+      }
+      uring_failed = true;
+   }
+   if (memsim_data_begin(fd, sim_size, emu_cmd) < 0) return -1;
+   res = write_all(fd, data, sim_size, progress, divider);
+   stats_phase(PHASE_DATA, start);
+   if (res < 0)
+   {
+      perror("Error: Failed to write data");
+      return -1;
+   }
+   dump_sim_mem(data, sim_size);
+   return memsim_data_end(fd, emu_cmd);
+}
+
+// Reset pulse from -r value: 0 disables, > 0 positive, < 0 negative pulse
+int
+reset_config(long value, struct EmuConfig *config)
+{
+   if (value < -255 || value > 255) return -1;
+   if (value == 0)
+   {
+      config->reset_enable = '0';
+      config->reset_time = 0;
+   }
+   else if (value > 0)
+   {
+      config->reset_enable = 'P';
+      config->reset_time = value;
+   }
+   else
+   {
+      config->reset_enable = 'N';
+      config->reset_time = -value;
+   }
+   return 0;
+}
+
+// The image buffer covers the given chips, or all of the simulator, once
+// per byte lane. Only a single lane fits into the static buffer.
+void
+set_window(const struct MemType *mem_type, int lanes)
+{
+   window_size = (long)(mem_type_given ? mem_type->size : SIMMEMSIZE) * lanes;
+}
+
+// Read an image, select chip type and simulated size and apply the board
+// profile. For byte lanes, chip and size refer to a single lane and the
+// board profile is applied later per lane.
+// Returns the size of the image data or -1 on error.
+int
+prepare_image(const char *filename, uint8_t *mem, long offset, int lanes,
+      const struct MemType **mem_type, int *sim_size)
+{
+   long min, max;
+   int image_size;
+   int detected_size;
+
+   set_window(*mem_type, lanes);
+   image_size = read_image(filename, mem, offset, &min, &max, NULL);
+   if (image_size < 0) return -1;
+   detected_size = image_size;
+   if (lanes > 1)
+   {
+      // Chip type and size checks apply to each single lane
+      detected_size = (image_size + lanes - 1) / lanes;
+      printf("Info: %d bytes split into %d byte lanes of %d bytes\n",
+            image_size, lanes, detected_size);
+   }
+   *mem_type = select_mem_type(*mem_type, detected_size, sim_size);
+   if (!*mem_type) return -1;
+   // Checksums refer to the addresses seen by the CPU, before scrambling
+   if (checksum_apply(mem, *sim_size * lanes) < 0) return -1;
+   if (lanes == 1 && scramble_apply(mem, *sim_size) < 0) return -1;
+   return image_size;
+}
+
+// Configure the simulator and upload sim_size bytes of mem
+int
+send_image(int fd, const struct EmuConfig *config, uint8_t *mem, int sim_size)
+{
+   int divider; // Used to fake 2K or 4K progress bar when actually 8K are transmitted
+
+   if (memsim_config(fd, config) < 0) return -1;
+
+   divider = mirror_small_image(mem, config->mem_type, &sim_size);
+   if (memsim_upload(fd, mem, sim_size, true, divider) < 0) return -1;
+   printf("\n");
+   return 0;
+}
 
 
 int
@@ -527,45 +946,60 @@ main(int argc, char *argv[])
 {
    int res;
    int fd;
-   unsigned int i;
    long offset = 0;
-   char reset_enable = 'N';
-   short int reset_time = 200;
-   const struct MemType *mem_type = &memory_types[3];
-   int detected_size = 0;
+   struct EmuConfig config = { NULL, 'N', 200, 'D', 'N' };
+   const struct MemType *mem_type;
+   char *mem_type_name = "27128";
    int sim_size;
-   int divider; // Used to fake 2K or 4K progress bar when actually 8K are transmitted
-   char emu_enable = 'D';
-   char selftest = 'N';
    char *device = NULL;
+   char *devices[MAX_DEVICES];
+   int device_count = 0;
+   int lanes = 1;
+   int image_size;
+   bool pipeline = false;
+   char *script = NULL;
+   bool watch = false;
+   char *history = NULL;
+   char *metrics = NULL;
+   char *trace = NULL;
+   char *capture = NULL;
+   bool fast_replay = false;
+   bool check = false;
+   char *export = NULL;
+   bool report = false;
+   bool shadow = false;
+   bool banks = false;
+   int diag = 0;
+   int image_fd = -1;
+   char *format = NULL;
+   const char *filename;
+   const uint8_t *image = NULL;
+   uint8_t *buffer = NULL;
+   char *shadow_dir = NULL;
+   int jobs = 0;
+   double start;
+   double cpu;
+   int policy = -1;
+   int pin_cpu = -1;
    int opt;
-   char emu_cmd[16+1];
-   char emu_reply[16+1];
    int value;
-   int min, max;
    char *endptr;
 
-   while ((opt = getopt(argc, argv, "hd:m:o:r:e")) != -1) {
+   while ((opt = getopt_long(argc, argv, "hd:m:o:r:epl:b:s:wH:M:C:R:Fx:c:", long_options, NULL)) != -1) {
       switch (opt) {
          case 'd':
-            device = optarg;
-            break;
-         case 'm':
-            mem_type_given = true;
-            mem_type = NULL;
-            for (i = 0; i < (sizeof(memory_types) / sizeof(memory_types[0])); i++)
-            {
-               if (strcmp(optarg, memory_types[i].name) == 0)
-               {
-                  mem_type = &memory_types[i];
-                  break;
-               }
-            }
-            if (!mem_type)
+            if (device_count == MAX_DEVICES)
             {
-               fprintf(stderr, "Error: Unknown memory type\n");
+               fprintf(stderr, "Error: Too many devices (max. %d)\n", MAX_DEVICES);
                return EXIT_FAILURE;
             }
+            devices[device_count++] = optarg;
+            device = devices[0];
+            break;
+         case 'm':
+            // Looked up after all options, custom chips may follow
+            mem_type_given = true;
+            mem_type_name = optarg;
             break;
          case 'o':
             offset_given = true;
@@ -575,30 +1009,111 @@ main(int argc, char *argv[])
          case 'r':
             value = strtol(optarg, &endptr, 0);
             check_input(optarg, endptr);
-            if (value < -255 || value > 255)
+            if (reset_config(value, &config) < 0)
             {
                fprintf(stderr, "Error: Reset time out of range\n");
                return EXIT_FAILURE;
             }
-            if (value == 0)
-            {
-               reset_enable = '0';
-               reset_time = 0;
-            }
-            else if (value > 0)
+            break;
+         case 'e':
+            config.emu_enable = 'E';
+            break;
+         case 'p':
+            pipeline = true;
+            break;
+         case 's':
+            script = optarg;
+            break;
+         case 'w':
+            watch = true;
+            break;
+         case 'H':
+            history = optarg;
+            break;
+         case 'M':
+            metrics = optarg;
+            break;
+         case 'C':
+            capture = optarg;
+            break;
+         case 'R':
+            trace = optarg;
+            break;
+         case 'F':
+            fast_replay = true;
+            break;
+         case 'x':
+            export = optarg;
+            break;
+         case 'c':
+            if (checksum_add(optarg) < 0) return EXIT_FAILURE;
+            break;
+         case OPT_REPORT:
+            report = true;
+            break;
+         case OPT_CHIPS:
+            if (chip_load_profiles(optarg) < 0) return EXIT_FAILURE;
+            break;
+         case OPT_SHADOW:
+            shadow = true;
+            shadow_dir = optarg;
+            break;
+         case OPT_URING:
+            use_uring = true;
+            break;
+         case OPT_REALTIME:
+            policy = realtime_policy(optarg);
+            if (policy < 0) return EXIT_FAILURE;
+            break;
+         case OPT_CPU:
+            pin_cpu = strtol(optarg, &endptr, 0);
+            check_input(optarg, endptr);
+            break;
+         case OPT_STALLS:
+            stalls_enable();
+            break;
+         case OPT_BANKS:
+            banks = true;
+            break;
+         case OPT_FD:
+            image_fd = strtol(optarg, &endptr, 0);
+            check_input(optarg, endptr);
+            break;
+         case OPT_FORMAT:
+            format = optarg;
+            break;
+         case OPT_DIAG:
+            diag = 100;
+            if (optarg)
             {
-               reset_enable = 'P';
-               reset_time = value;
+               diag = strtol(optarg, &endptr, 0);
+               check_input(optarg, endptr);
+               if (diag < 1)
+               {
+                  fprintf(stderr, "Error: Number of round trips must be at least 1\n");
+                  return EXIT_FAILURE;
+               }
             }
-            else
+            break;
+         case OPT_CHECK:
+            check = true;
+            break;
+         case OPT_JOBS:
+            jobs = strtol(optarg, &endptr, 0);
+            check_input(optarg, endptr);
+            break;
+         case 'b':
+            if (scramble_load(optarg) < 0) return EXIT_FAILURE;
+            break;
+         case 'l':
+            lanes = strtol(optarg, &endptr, 0);
+            check_input(optarg, endptr);
+            if (lanes != 1 && lanes != 2 && lanes != 4)
             {
-               reset_enable = 'N';
-               reset_time = -value;
+               fprintf(stderr, "Error: Number of byte lanes must be 1, 2 or 4\n");
+               return EXIT_FAILURE;
             }
             break;
-         case 'e':
-            emu_enable = 'E';
-            break;
          case 'h':
             usage();
             return EXIT_SUCCESS;
@@ -613,178 +1128,236 @@ main(int argc, char *argv[])
       usage();
       return EXIT_SUCCESS;
    }
-
-   res = read_image(argv[optind], mem, offset, &min, &max);
-   if (res < 0)
+   stats_output(history, metrics);
+   if (capture)
    {
-      return EXIT_FAILURE;
+      // A trace holds the traffic of one device, replay acts as one simulator
+      if (device_count > 1)
+      {
+         fprintf(stderr, "Error: -C captures one device, it can't be combined with byte lanes or --banks\n");
+         return EXIT_FAILURE;
+      }
+      if (capture_open(capture) < 0) return EXIT_FAILURE;
    }
-   detected_size = res;
-   if (mem_type_given && (detected_size > mem_type->size))
+   // Both profiles are loaded now, in any order of the options
+   if (chip_check_profiles() < 0) return EXIT_FAILURE;
+   mem_type = find_mem_type(mem_type_name);
+   if (!mem_type)
    {
-      fprintf(stderr, "Too much data (%d bytes) for specified memory type (%d bytes)\n", detected_size, mem_type->size);
+      fprintf(stderr, "Error: Unknown memory type\n");
       return EXIT_FAILURE;
    }
-   bool size_is_standard_size = false;
-   for (i = 0; i < (sizeof(memory_types) / sizeof(memory_types[0])); i++)
+
+   if (trace)
+      return replay(trace, fast_replay) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+   if (check)
    {
-      if (memory_types[i].size == detected_size)
+      if (image_fd >= 0)
       {
-         size_is_standard_size = true;
-         break;
+         fprintf(stderr, "Error: --check validates image files, it can't be combined with --fd\n");
+         return EXIT_FAILURE;
       }
+      if (optind >= argc)
+      {
+         fprintf(stderr, "Error: No image file given\n");
+         return EXIT_FAILURE;
+      }
+      set_window(mem_type, lanes);
+      return check_images(argv + optind, argc - optind, mem_type_given ? mem_type : NULL,
+            offset, lanes, jobs);
    }
-   sim_size = mem_type_given ? mem_type->size : detected_size;
-   if (!size_is_standard_size)
+   if (diag)
    {
-      printf("Warning: non-standard binary size of %d bytes\n", detected_size);
-      if (!mem_type_given) {
-         for (i = 0; i < (sizeof(memory_types) / sizeof(memory_types[0])); i++)
-         {
-            sim_size = memory_types[i].size;
-            if (sim_size >= detected_size)
-            {
-               printf("Simulated size increased to %d bytes\n", sim_size);
-               break;
-            }
-         }
-      }
+      config.mem_type = mem_type;
+      return run_diagnostics(device, &config, diag) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
    }
-   if (mem_type_given && (detected_size != mem_type->size))
+   if (script)
    {
-      printf("Warning: binary size (%d bytes) doesn't match memory size (%d bytes)\n",
-            detected_size, mem_type->size);
+      fd = open_device(device);
+      if (fd < 0) return EXIT_FAILURE;
+      res = run_batch(script, fd, mem, offset, mem_type_given ? mem_type : NULL, &config);
+      close(fd);
+      return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
    }
-
-   /* Guess chip type from file size */
-   if (!mem_type_given)
+   if (format && image_fd < 0)
    {
-      mem_type = NULL;
-      for (i = 0; i < (sizeof(memory_types) / sizeof(memory_types[0])); i++)
-      {
-         if (memory_types[i].size == sim_size)
-         {
-            mem_type = &memory_types[i];
-            printf("%d bytes, must be a %s chip.\n", sim_size, mem_type->name);
-            break;
-         }
-      }
-      if (!mem_type)
+      fprintf(stderr, "Error: --format applies to images given with --fd\n");
+      return EXIT_FAILURE;
+   }
+   if (image_fd >= 0)
+   {
+      if (optind < argc)
       {
-         fprintf(stderr, "Can't autodetect chip type for %d bytes\n", sim_size);
+         fprintf(stderr, "Error: Image file given as well as --fd\n");
          return EXIT_FAILURE;
       }
-
+      filename = memfd_attach(image_fd, format);
+      if (!filename) return EXIT_FAILURE;
    }
+   else if (optind >= argc)
+   {
+      fprintf(stderr, "Error: No image file given\n");
+      return EXIT_FAILURE;
+   }
+   else
+      filename = argv[optind];
 
-   fd = serial_open(device == NULL ? UDEV_DEVICE : device);
-
-   if (fd < 0)
+   if (banks)
    {
-      printf("Looking for MEMSIM2 device");
-      if (detect_device())
+      if (device_count < 2 || lanes > 1 || export || pipeline || shadow || watch)
       {
-         fd = serial_open(device_name);
-         printf(": found %s\n", device_name);
-      } else {
-         printf(": not found\n");
+         fprintf(stderr, "Error: --banks needs two or more devices given with -d and can't be "
+               "combined with byte lanes, -p, -w, -x or --shadow\n");
+         return EXIT_FAILURE;
       }
+      config.mem_type = mem_type;
+      res = upload_banks(filename, offset, mem_type, devices, device_count, &config,
+            policy, pin_cpu);
+      stalls_report();
+      return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
    }
-
-   if (fd < 0)
+   if (device_count > 1 && device_count != lanes)
    {
-      printf("Trying default device: %s\n", DEFAULT_DEVICE);
-      fd = serial_open(DEFAULT_DEVICE);
-   }
-   if (fd < 0) return EXIT_FAILURE;
-
-   /* Configuration */
-   snprintf(emu_cmd, sizeof(emu_cmd), "MC%c%c%03u%c%c00023\r\n",
-         mem_type->cmd, reset_enable, (uint8_t)reset_time, emu_enable, selftest);
-
-   debug_printf("Config: %s\n", emu_cmd);
-   res = write_all(fd, (uint8_t*)emu_cmd, sizeof(emu_cmd) - 1, 0, 0);
-   if (res != sizeof(emu_cmd) - 1) {
-      perror("Failed to write configuration");
+      fprintf(stderr, "Error: %d devices given for %d byte lane(s)\n", device_count, lanes);
+      return EXIT_FAILURE;
    }
-   res = read_all(fd, (uint8_t*)emu_reply, 16, 5000);
-   if (res == 0)
+   if (lanes > 1 && device_count != lanes)
    {
-      fprintf(stderr, "Error: Timeout while waiting for configuration reply\n");
-      close(fd);
+      fprintf(stderr, "Error: %d byte lanes need %d devices given with -d\n", lanes, lanes);
       return EXIT_FAILURE;
    }
-   if (res != 16)
+   if (export && lanes > 1)
    {
-      perror("Error: Failed to read configuration reply");
-      close(fd);
+      fprintf(stderr, "Error: export is not available for byte lanes\n");
       return EXIT_FAILURE;
    }
-   emu_reply[16] = '\0';
-   debug_printf("Reply: %s\n", emu_reply);
-   if (memcmp(emu_cmd, emu_reply, 8) != 0)
+   set_window(mem_type, lanes);
+   if (pipeline && (lanes > 1 || scramble_active() || checksum_active() || export || report))
    {
-      fprintf(stderr, "Error: Response didn't match command\n");
+      printf("Info: pipelined mode not available for byte lanes, board profiles, checksums or export, using buffered mode\n");
+      pipeline = false;
+   }
+   if (pipeline)
+   {
+      if (!mem_type_given)
+      {
+         fprintf(stderr, "Error: -p requires a memory type given with -m\n");
+         return EXIT_FAILURE;
+      }
+      if (image_format(filename) != FORMAT_BINARY && !offset_given)
+      {
+         printf("Info: hex files need an offset (-o) for pipelined transfer, using buffered mode\n");
+         pipeline = false;
+      }
+   }
+   if (pipeline)
+   {
+      config.mem_type = mem_type;
+      if (policy >= 0 || pin_cpu >= 0)
+         realtime_begin(policy, pin_cpu, policy >= 0 ? mem : NULL, chip_send_size(mem_type));
+      cpu = stats_cpu();
+      fd = open_device(device);
+      if (fd < 0) return EXIT_FAILURE;
+      res = memsim_config(fd, &config);
+      if (res == 0) res = stream_upload(fd, filename, mem, offset, mem_type);
       close(fd);
-      return EXIT_FAILURE;
+      realtime_end();
+      stats.cpu = stats_cpu() - cpu;
+      stats_record(&stats, device_name, mem_type->name, mem_type->size, res >= 0);
+      if (res < 0) return EXIT_FAILURE;
+      printf("\n");
+      stalls_report();
+      if (res != mem_type->size)
+      {
+         printf("Warning: binary size (%d bytes) doesn't match memory size (%d bytes)\n",
+               res, mem_type->size);
+      }
+      return EXIT_SUCCESS;
    }
 
-   divider = 1;
-   // Faking 8 KB chip from 2 KB data
-   if (sim_size == 2048)
+   start = stats_now();
+   // Images from --fd that need no changes are sent from their mapping
+   if (image_fd >= 0 && lanes == 1 && !report && !export && !watch)
+      image = memfd_direct(&mem_type, &sim_size);
+   if (image)
+      res = sim_size;
+   else
    {
-      memcpy(mem + 2048, mem, 2048);
-      memcpy(mem + 4096, mem, 4096);
-      sim_size = 8192;
-      divider = 4;
+      buffer = (lanes > 1) ? calloc(window_size, 1) : mem;
+      if (!buffer)
+      {
+         perror("Error: Failed to allocate image buffer");
+         return EXIT_FAILURE;
+      }
+      res = prepare_image(filename, buffer, offset, lanes, &mem_type, &sim_size);
+      image = buffer;
    }
-   // Faking 8 KB chip from 4 KB data
-   if (sim_size == 4096)
+   stats_phase(PHASE_PARSE, start);
+   if (res < 0) return EXIT_FAILURE;
+   image_size = res;
+
+   config.mem_type = mem_type;
+
+   if (report) return EXIT_SUCCESS;
+   if (export)
    {
-      memcpy(mem + 4096, mem, 4096);
-      sim_size = 8192;
-      divider = 2;
+      // Exactly the bytes that would be sent, including mirroring
+      mirror_small_image(mem, mem_type, &sim_size);
+      return export_image(export, mem, sim_size) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
    }
-   snprintf(emu_cmd, sizeof(emu_cmd), "MD%04d00000058\r\n",sim_size / 1024 % 1000);
-   debug_printf("Data: %s\n", emu_cmd);
-   //printf("Writing %d bytes to simulator...\n", sim_size);
-   res = write_all(fd, (uint8_t*)emu_cmd, sizeof(emu_cmd) - 1, 0, 0);
-   if (res != sizeof(emu_cmd) - 1)
+   if (policy >= 0 || pin_cpu >= 0)
    {
-      perror("Error: Failed to write data header");
+      realtime_begin(policy, pin_cpu, policy >= 0 ? image : NULL,
+            lanes > 1 ? image_size : chip_send_size(mem_type));
    }
-   res = write_all(fd, mem, sim_size, 1, divider);
-   if (res < 0)
+   cpu = stats_cpu();
+   if (lanes > 1)
    {
-      perror("Error: Failed to write data");
-      close(fd);
-      return EXIT_FAILURE;
+      res = upload_lanes(buffer, image_size, lanes, devices, &config);
+      free(buffer);
+      realtime_end();
+      stats.cpu = stats_cpu() - cpu;
+      printf("Info: %ld system calls, %.3f s CPU\n", stats.syscalls, stats.cpu);
+      stalls_report();
+      return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
    }
-   dump_sim_mem(mem, sim_size);
 
-   res = read_all(fd, (uint8_t*)emu_reply, 16, 15000);
-   if (res == 0)
+   start = stats_now();
+   fd = open_device(device);
+   stats_phase(PHASE_OPEN, start);
+   res = -1;
+   if (fd >= 0 && shadow && shadow_open(shadow_dir, device_name) < 0)
    {
-      fprintf(stderr, "Error: Timeout while waiting for write operation\n");
       close(fd);
-      return EXIT_FAILURE;
+      fd = -1;
    }
-   if (res != 16)
-   {
-      perror("Error: Failed to read data reply");
-      close(fd);
-      return EXIT_FAILURE;
-   }
-   emu_reply[16] = '\0';
-   debug_printf("Reply: %s\n", emu_reply);
-   if (memcmp(emu_cmd, emu_reply, 8) != 0)
+   if (fd >= 0)
    {
-      fprintf(stderr, "Error: Response didn't match command\n");
+      if (shadow_compare(&config, image, sim_size) == 1)
+      {
+         // The configuration is sent anyway, for its reset pulse
+         res = memsim_config(fd, &config) < 0 ? -1 : 0;
+         if (res < 0) shadow_invalidate();
+      }
+      else
+      {
+         // The first sim_size bytes are not touched by mirroring
+         if (image != mem)
+            res = memfd_send(fd, &config, image, sim_size);
+         else
+            res = send_image(fd, &config, mem, sim_size);
+         if (res == 0) shadow_store(&config, image, sim_size);
+      }
       close(fd);
-      return EXIT_FAILURE;
    }
-   printf("\n");
-
-   close(fd);
+   realtime_end();
+   stats.cpu = stats_cpu() - cpu;
+   if (res == 0 && stats.syscalls)
+      printf("Info: %ld system calls, %.3f s CPU\n", stats.syscalls, stats.cpu);
+   stalls_report();
+   stats_record(&stats, device_name, mem_type->name, sim_size, res == 0);
+   if (res < 0 && !watch) return EXIT_FAILURE;
+   if (watch)
+      return hotplug_watch(device, &config, mem, sim_size) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
    return EXIT_SUCCESS;
 }
@@ -22,8 +22,110 @@
 
 #define SIMMEMSIZE (512 * 1024)
 
+// Size of MC and MD command strings including terminating zero
+#define MEMSIM_CMD_SIZE (16+1)
+
+struct MemType
+{
+   const char *name;
+   char cmd;
+   int size;
+};
+
+// Result of the chip selection for an image
+struct ChipPlan
+{
+   const struct MemType *type;
+   int image_size;      // bytes of image data
+   int sim_size;        // size of the simulated chip
+   int padding;         // bytes after the image data up to sim_size
+   int send_size;       // bytes sent to the simulator
+   int copies;          // number of copies of the chip sent
+   bool standard_size;  // image size matches a chip
+};
+
+struct EmuConfig
+{
+   const struct MemType *mem_type;
+   char reset_enable;
+   short int reset_time;
+   char emu_enable;
+   char selftest;
+};
+
+// Devices driven concurrently, e.g. for byte lanes
+#define MAX_DEVICES 8
+#define MAX_LANES   4
+#define MAX_CHECK_JOBS 64
+#define SNIFF_SIZE  512       // bytes inspected to detect the format
+
+// Exit status bits of --check
+#define CHECK_PARSE_ERROR 1
+#define CHECK_SIZE_ERROR  2
+
+enum Phase
+{
+   PHASE_PARSE,
+   PHASE_OPEN,
+   PHASE_CONFIG,
+   PHASE_DATA,
+   PHASE_REPLY,
+   PHASES
+};
+
+struct UploadStats
+{
+   double phase[PHASES];        // seconds
+   int timeouts;
+   long syscalls;               // reads, writes, polls and io_uring calls
+   double cpu;                  // user and system seconds of the upload
+};
+
+// Per thread, the threads of upload_parallel() collect their own
+extern __thread struct UploadStats stats;
+
+struct UploadJob
+{
+   const char *device;
+   struct EmuConfig config;
+   uint8_t *data;
+   int size;
+   int result;
+   double seconds;
+   struct UploadStats stats;
+};
+
+enum ImageFormat
+{
+   FORMAT_NONE,         // no suffix
+   FORMAT_UNKNOWN,
+   FORMAT_IHEX,
+   FORMAT_SREC,
+   FORMAT_BINARY,
+   FORMAT_ELF
+};
+
 extern bool offset_given;
 extern bool mem_type_given;
+extern long window_size;
+extern bool use_uring;
+extern char device_name[];     // device opened by open_device()
+
+// Optional record of which buffer bytes an image has set
+struct Coverage
+{
+   uint8_t *map;        // one byte per buffer byte, non-zero if set
+   long base;           // address of first buffer byte
+   long ignored;        // bytes outside of the window
+};
+
+struct Window
+{
+   long base;           // address of first buffer byte
+   long end;            // end of stored data
+   bool anchored;       // base is known
+   struct Coverage *coverage;
+};
 
 void skip_white(FILE *file);
 void ignore_rest_of_line(FILE *file);
@@ -35,5 +137,136 @@ int get_hex6(FILE *file, int *check);               // 24 bit
 long long int get_hex8(FILE *file, int *check);     // 32 bit
 
 
-int parse_ihex(FILE *file, uint8_t *buffer, int *min, int *max, long offset);
-int parse_srec(FILE *file, uint8_t *buffer, int *min, int *max, long offset);
+enum ImageFormat image_format(const char *filename);
+int read_image(const char *filename, uint8_t *mem, long offset, long *min, long *max,
+      struct Coverage *coverage);
+
+int skip_hex(FILE *file, int count, int *check);
+void window_init(struct Window *window, long offset, struct Coverage *coverage);
+long window_index(struct Window *window, uint8_t *buffer, long addr, int length);
+
+int parse_ihex(FILE *file, uint8_t *buffer, long *min, long *max, long offset,
+      struct Coverage *coverage);
+int parse_srec(FILE *file, uint8_t *buffer, long *min, long *max, long offset,
+      struct Coverage *coverage);
+
+int write_all(int fd, const uint8_t *data, size_t count, int progress, int divider);
+int read_all(int fd, uint8_t *data, size_t count, int timeout);
+void print_progress(size_t position, size_t endpos);
+
+int serial_open(const char *device);
+int open_device(const char *device);
+void memsim_config_cmd(const struct EmuConfig *config, char *emu_cmd);
+int memsim_config(int fd, const struct EmuConfig *config);
+int memsim_data_begin(int fd, int sim_size, char *emu_cmd);
+int memsim_data_end(int fd, const char *emu_cmd);
+int memsim_upload(int fd, const uint8_t *data, int sim_size, bool progress, int divider);
+
+int reset_config(long value, struct EmuConfig *config);
+void set_window(const struct MemType *mem_type, int lanes);
+int prepare_image(const char *filename, uint8_t *mem, long offset, int lanes,
+      const struct MemType **mem_type, int *sim_size);
+int send_image(int fd, const struct EmuConfig *config, uint8_t *mem, int sim_size);
+
+// stream.c
+void stream_record(long addr);
+int stream_upload(int fd, const char *filename, uint8_t *mem, long offset,
+      const struct MemType *mem_type);
+
+// lanes.c
+void deinterleave(const uint8_t *src, size_t count, uint8_t **lane, int lanes);
+int upload_parallel(struct UploadJob *jobs, int count);
+int upload_lanes(const uint8_t *mem, int image_size, int lanes, char **devices,
+      const struct EmuConfig *config);
+
+// banks.c
+int upload_banks(const char *filename, long offset, const struct MemType *mem_type,
+      char **devices, int banks, const struct EmuConfig *config, int policy, int cpu);
+
+// diag.c
+int run_diagnostics(const char *device, const struct EmuConfig *config, int iterations);
+
+// memfd.c
+const char *memfd_attach(int fd, const char *format);
+bool memfd_is(const char *filename);
+FILE *memfd_open(void);
+const uint8_t *memfd_direct(const struct MemType **mem_type, int *sim_size);
+int memfd_send(int fd, const struct EmuConfig *config, const uint8_t *data, int sim_size);
+
+// scramble.c
+int scramble_load(const char *filename);
+bool scramble_active(void);
+bool scramble_fits(int size);
+int scramble_apply(uint8_t *buffer, int size);
+
+// batch.c
+int run_batch(const char *script, int fd, uint8_t *mem, long offset,
+      const struct MemType *mem_type, const struct EmuConfig *config);
+
+// hotplug.c
+int hotplug_watch(const char *device, const struct EmuConfig *config, uint8_t *mem, int sim_size);
+
+// metrics.c
+double stats_now(void);
+void stats_phase(enum Phase phase, double start);
+void stats_syscalls(long count);
+double stats_cpu(void);
+void stats_sort(double *samples, int count);
+double stats_percentile(const double *sorted, int count, int p);
+void stats_output(const char *history, const char *metrics);
+void stats_record(const struct UploadStats *s, const char *device, const char *chip, int bytes, bool ok);
+
+// capture.c
+int capture_open(const char *filename);
+void capture_record(char direction, const uint8_t *data, size_t count);
+int replay(const char *filename, bool fast);
+
+// check.c
+int check_images(char **files, int count, const struct MemType *mem_type, long offset,
+      int lanes, int jobs);
+
+// export.c
+int export_image(const char *filename, const uint8_t *data, int size);
+
+// checksum.c
+int checksum_add(const char *spec);
+bool checksum_active(void);
+int checksum_apply(uint8_t *mem, int size);
+
+// decompress.c
+size_t compressed_suffix(const char *filename);
+FILE *image_open(const char *filename, bool *piped);
+FILE *image_create(const char *filename, bool *piped);
+int image_close(FILE *file, bool piped);
+
+// sniff.c
+enum ImageFormat sniff_format(const uint8_t *block, size_t size);
+FILE *prefix_file(FILE *file, const uint8_t *block, size_t size);
+
+// chip.c
+const struct MemType *find_mem_type(const char *name);
+int chip_send_size(const struct MemType *mem_type);
+int chip_load_profiles(const char *filename);
+int chip_check_profiles(void);
+int chip_plan(const struct MemType *mem_type, int detected_size, struct ChipPlan *plan);
+const struct MemType *select_mem_type(const struct MemType *mem_type, int detected_size, int *sim_size);
+int mirror_small_image(uint8_t *mem, const struct MemType *mem_type, int *sim_size);
+
+// shadow.c
+int shadow_open(const char *dir, const char *device);
+int shadow_compare(const struct EmuConfig *config, const uint8_t *mem, int size);
+void shadow_invalidate(void);
+void shadow_store(const struct EmuConfig *config, const uint8_t *mem, int size);
+
+// uring.c
+#define URING_UNAVAILABLE (-2)  // nothing sent, use the conventional path
+int uring_upload(int fd, const char *emu_cmd, const uint8_t *data, int size, char *reply,
+      int timeout, bool progress, int divider);
+
+// realtime.c
+int realtime_policy(const char *name);
+void realtime_begin(int policy, int cpu, const void *buffer, size_t size);
+void realtime_end(void);
+void stalls_enable(void);
+void stalls_record(double seconds);
+void stalls_report(void);
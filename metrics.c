@@ -0,0 +1,376 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memsim2.h"
+
+// Upload statistics: an append-only history log with one line per upload
+// and a Prometheus textfile collector file with counters and histograms.
+// Phases are timed during the upload, the files are only written after
+// the final reply of the simulator.
+
+__thread struct UploadStats stats;
+
+static const char *phase_names[PHASES] = { "parse", "open", "config", "data", "reply" };
+
+double
+stats_now(void)
+{
+   struct timespec t;
+
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void
+stats_phase(enum Phase phase, double start)
+{
+   stats.phase[phase] += stats_now() - start;
+}
+
+// Count system calls of the transfer
+void
+stats_syscalls(long count)
+{
+   stats.syscalls += count;
+}
+
+// User and system CPU time of the process in seconds
+double
+stats_cpu(void)
+{
+   struct rusage usage;
+
+   if (getrusage(RUSAGE_SELF, &usage) < 0) return 0;
+   return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+   double x = *(const double *)a;
+   double y = *(const double *)b;
+
+   return (x > y) - (x < y);
+}
+
+void
+stats_sort(double *samples, int count)
+{
+   qsort(samples, count, sizeof(*samples), compare_double);
+}
+
+// Nearest rank percentile of count sorted samples
+double
+stats_percentile(const double *sorted, int count, int p)
+{
+   int rank = (p * count + 99) / 100;
+
+   return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static const char *
+outcome(const struct UploadStats *s, bool ok)
+{
+   if (ok) return "ok";
+   return s->timeouts ? "timeout" : "error";
+}
+
+static int
+history_write(const char *filename, const struct UploadStats *s, const char *device,
+      const char *chip, int bytes, bool ok)
+{
+   char stamp[32];
+   time_t t = time(NULL);
+   double total = 0;
+   FILE *file;
+   int i;
+
+   file = fopen(filename, "a");
+   if (!file)
+   {
+      fprintf(stderr, "Error: Failed to open history log '%s': %s\n", filename, strerror(errno));
+      return -1;
+   }
+   strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+   fprintf(file, "%s device=%s chip=%s bytes=%d", stamp, device, chip ? chip : "-", bytes);
+   for (i = 0; i < PHASES; i++)
+   {
+      fprintf(file, " %s=%.3f", phase_names[i], s->phase[i]);
+      total += s->phase[i];
+   }
+   fprintf(file, " total=%.3f syscalls=%ld cpu=%.3f result=%s\n", total, s->syscalls, s->cpu,
+         outcome(s, ok));
+   if (fclose(file) != 0)
+   {
+      fprintf(stderr, "Error: Failed to write history log '%s'\n", filename);
+      return -1;
+   }
+   return 0;
+}
+
+// Prometheus text format. The file is read back, updated and replaced
+// atomically, so counters accumulate over all runs. Processes sharing
+// the file serialize the update with a lock on FILE.lock.
+
+#define MAX_SAMPLES 1024
+
+struct Sample
+{
+   char key[200];       // metric name with labels
+   double value;
+};
+
+struct Family
+{
+   const char *name;
+   const char *type;
+   const char *help;
+};
+
+static const struct Family families[] =
+{
+   { "memsim2_uploads_total", "counter", "Number of uploads by outcome" },
+   { "memsim2_upload_bytes_total", "counter", "Bytes sent to the simulator" },
+   { "memsim2_handshake_timeouts_total", "counter", "Timeouts waiting for a simulator reply" },
+   { "memsim2_upload_duration_seconds", "histogram", "Duration of complete uploads" },
+   { "memsim2_last_phase_seconds", "gauge", "Duration of each phase of the last upload" },
+   { "memsim2_syscalls_total", "counter", "System calls for serial transfers" },
+   { "memsim2_cpu_seconds_total", "counter", "CPU time spent on uploads" },
+};
+
+#define FAMILIES (sizeof(families) / sizeof(families[0]))
+
+static const double buckets[] = { 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 15, 30 };
+
+#define BUCKETS (sizeof(buckets) / sizeof(buckets[0]))
+
+static struct Sample *samples;
+static int sample_count;
+
+static struct Sample *
+sample(const char *key)
+{
+   int i;
+
+   for (i = 0; i < sample_count; i++)
+      if (!strcmp(samples[i].key, key)) return &samples[i];
+   if (sample_count == MAX_SAMPLES) return NULL;
+   snprintf(samples[sample_count].key, sizeof(samples[0].key), "%s", key);
+   samples[sample_count].value = 0;
+   return &samples[sample_count++];
+}
+
+static void
+sample_add(const char *key, double value)
+{
+   struct Sample *s = sample(key);
+
+   if (s) s->value += value;
+}
+
+static void
+sample_set(const char *key, double value)
+{
+   struct Sample *s = sample(key);
+
+   if (s) s->value = value;
+}
+
+static int
+family_of(const char *key)
+{
+   unsigned int i;
+
+   for (i = 0; i < FAMILIES; i++)
+   {
+      size_t len = strlen(families[i].name);
+
+      if (!strncmp(key, families[i].name, len) &&
+          (key[len] == '{' || key[len] == '_' || key[len] == '\0'))
+         return i;
+   }
+   return -1;
+}
+
+static void
+load_samples(const char *filename)
+{
+   char line[256];
+   FILE *file = fopen(filename, "r");
+
+   if (!file) return;
+   while (fgets(line, sizeof(line), file))
+   {
+      char *space;
+
+      if (line[0] == '#') continue;
+      space = strrchr(line, ' ');
+      if (!space) continue;
+      *space = '\0';
+      if (family_of(line) < 0) continue;
+      sample_set(line, strtod(space + 1, NULL));
+   }
+   fclose(file);
+}
+
+// Label value with \\, " and newline escaped
+static void
+escape_label(const char *value, char *out, size_t size)
+{
+   size_t n = 0;
+
+   for (; *value && n + 3 < size; value++)
+   {
+      if (*value == '\\' || *value == '"')
+         out[n++] = '\\';
+      else if (*value == '\n')
+      {
+         out[n++] = '\\';
+         out[n++] = 'n';
+         continue;
+      }
+      out[n++] = *value;
+   }
+   out[n] = '\0';
+}
+
+static int
+write_samples(FILE *file)
+{
+   unsigned int f;
+   int i;
+
+   for (f = 0; f < FAMILIES; f++)
+   {
+      fprintf(file, "# HELP %s %s\n# TYPE %s %s\n",
+            families[f].name, families[f].help, families[f].name, families[f].type);
+      for (i = 0; i < sample_count; i++)
+         if (family_of(samples[i].key) == (int)f)
+            fprintf(file, "%s %.17g\n", samples[i].key, samples[i].value);
+   }
+   return ferror(file) ? -1 : 0;
+}
+
+static int
+metrics_write(const char *filename, const struct UploadStats *s, const char *device_path,
+      int bytes, bool ok)
+{
+   char key[200];
+   char device[100];
+   char tmpname[4096];
+   double total = 0;
+   unsigned int f;
+   int i;
+   int lock;
+   int fd;
+   FILE *file;
+   int res = -1;
+
+   escape_label(device_path, device, sizeof(device));
+   snprintf(tmpname, sizeof(tmpname), "%s.lock", filename);
+   lock = open(tmpname, O_RDWR | O_CREAT, 0644);
+   if (lock < 0 || flock(lock, LOCK_EX) < 0)
+   {
+      fprintf(stderr, "Error: Failed to lock '%s': %s\n", tmpname, strerror(errno));
+      if (lock >= 0) close(lock);
+      return -1;
+   }
+   samples = calloc(MAX_SAMPLES, sizeof(*samples));
+   if (!samples)
+   {
+      perror("Error: Failed to allocate metrics");
+      close(lock);
+      return -1;
+   }
+   sample_count = 0;
+   load_samples(filename);
+
+   for (i = 0; i < PHASES; i++) total += s->phase[i];
+   snprintf(key, sizeof(key), "memsim2_uploads_total{device=\"%s\",outcome=\"%s\"}", device, outcome(s, ok));
+   sample_add(key, 1);
+   snprintf(key, sizeof(key), "memsim2_upload_bytes_total{device=\"%s\"}", device);
+   sample_add(key, ok ? bytes : 0);
+   snprintf(key, sizeof(key), "memsim2_handshake_timeouts_total{device=\"%s\"}", device);
+   sample_add(key, s->timeouts);
+   snprintf(key, sizeof(key), "memsim2_syscalls_total{device=\"%s\"}", device);
+   sample_add(key, s->syscalls);
+   snprintf(key, sizeof(key), "memsim2_cpu_seconds_total{device=\"%s\"}", device);
+   sample_add(key, s->cpu);
+   for (f = 0; f < BUCKETS; f++)
+   {
+      snprintf(key, sizeof(key), "memsim2_upload_duration_seconds_bucket{device=\"%s\",le=\"%g\"}",
+            device, buckets[f]);
+      sample_add(key, total <= buckets[f]);
+   }
+   snprintf(key, sizeof(key), "memsim2_upload_duration_seconds_bucket{device=\"%s\",le=\"+Inf\"}", device);
+   sample_add(key, 1);
+   snprintf(key, sizeof(key), "memsim2_upload_duration_seconds_sum{device=\"%s\"}", device);
+   sample_add(key, total);
+   snprintf(key, sizeof(key), "memsim2_upload_duration_seconds_count{device=\"%s\"}", device);
+   sample_add(key, 1);
+   // Only labels that stay the same for a device, a series per chip
+   // would keep the phases of an older upload
+   for (i = 0; i < PHASES; i++)
+   {
+      snprintf(key, sizeof(key), "memsim2_last_phase_seconds{device=\"%s\",phase=\"%s\"}",
+            device, phase_names[i]);
+      sample_set(key, s->phase[i]);
+   }
+
+   // Temporary file next to the target, so it can be renamed over it
+   snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+   fd = mkstemp(tmpname);
+   file = (fd < 0) ? NULL : fdopen(fd, "w");
+   if (!file)
+   {
+      fprintf(stderr, "Error: Failed to create '%s': %s\n", tmpname, strerror(errno));
+      if (fd >= 0)
+      {
+         close(fd);
+         unlink(tmpname);
+      }
+      goto out;
+   }
+   fchmod(fd, 0644);    // readable by the collector, mkstemp creates 0600
+   if (write_samples(file) < 0 || fclose(file) != 0 || rename(tmpname, filename) < 0)
+   {
+      fprintf(stderr, "Error: Failed to write metrics file '%s'\n", filename);
+      unlink(tmpname);
+      goto out;
+   }
+   res = 0;
+out:
+   free(samples);
+   close(lock);
+   return res;
+}
+
+static const char *history_file;
+static const char *metrics_file;
+
+// Files given with -H and -M, NULL if not given
+void
+stats_output(const char *history, const char *metrics)
+{
+   history_file = history;
+   metrics_file = metrics;
+}
+
+// Record one upload to one device in the history log and the metrics
+void
+stats_record(const struct UploadStats *s, const char *device, const char *chip, int bytes, bool ok)
+{
+   if (history_file) history_write(history_file, s, device, chip, bytes, ok);
+   if (metrics_file) metrics_write(metrics_file, s, device, bytes, ok);
+}
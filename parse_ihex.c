@@ -10,22 +10,27 @@
 static const char* errmsg = "Error in Intel hex file: ";
 
 int
-parse_ihex(FILE *file, uint8_t *buffer, int *min, int *max, long offset)
+parse_ihex(FILE *file, uint8_t *buffer, long *min, long *max, long offset,
+      struct Coverage *coverage)
 {
    int ch;
    *max = 0;
-   *min = INT_MAX;
+   *min = LONG_MAX;
    int actual_size = 0;
    int bytes_ignored = 0;
    long long upper16 = 0;
    long long segment = 0;
+   struct Window window;
+
+   window_init(&window, offset, coverage);
 
    while (1)
    {
       int check;
       int b;
       int length;
-      int addr;
+      long addr;
+      long idx;
       int type;
 
       skip_white(file);
@@ -59,22 +64,41 @@ parse_ihex(FILE *file, uint8_t *buffer, int *min, int *max, long offset)
       }
       if (type == 0)
       {
-         for (b = 0; b < length; b++)
+         idx = window_index(&window, buffer, addr, length);
+         if (idx + length <= 0 || idx >= window_size)
          {
-            int v = get_hex2(file, &check);
-            if (v < 0)
+            // Whole record outside of window, only check the data
+            if (skip_hex(file, length, &check) < 0)
             {
                fprintf(stderr, "%sillegal character in data field\n", errmsg);
-               return v;
+               return -1;
+            }
+            bytes_ignored += length;
+         }
+         else
+         {
+            if (idx >= 0) stream_record(idx);
+            for (b = 0; b < length; b++)
+            {
+               int v = get_hex2(file, &check);
+               if (v < 0)
+               {
+                  fprintf(stderr, "%sillegal character in data field\n", errmsg);
+                  return v;
+               }
+               if (idx >= 0 && idx < window_size)
+               {
+                  buffer[idx] = v;
+                  if (coverage) coverage->map[idx] = 1;
+                  if (addr > *max) *max = addr;
+                  if (addr < *min) *min = addr;
+               }
+               else
+                  bytes_ignored++;
+               addr++;
+               idx++;
             }
-            if ((addr - offset) >= 0)
-               buffer[addr - offset] = v;
-            else
-               bytes_ignored++;
-            if (addr > *max) *max = addr;
-            if (addr < *min) *min = addr;
             actual_size = *max - *min + 1;
-            addr++;
          }
       }
       else if (type == 2)
@@ -154,13 +178,18 @@ parse_ihex(FILE *file, uint8_t *buffer, int *min, int *max, long offset)
          return -3;
       }
    }
-   printf("Info: Intel hex data from %04Xh - %04Xh = %d bytes\n", *min, *max, actual_size);
+   if (actual_size == 0) *min = 0;
+   printf("Info: Intel hex data from %04lXh - %04lXh = %d bytes\n", *min, *max, actual_size);
    if (bytes_ignored) printf("Info: %d bytes outside storage area ignored\n", bytes_ignored);
+   if (coverage)
+   {
+      coverage->base = window.base;
+      coverage->ignored = bytes_ignored;
+   }
    if (!offset_given)
    {
-      printf("Info: no offset specified, simulated data starts at %Xh\n", *min);
-      memmove(buffer, buffer + *min, actual_size);
-      memset(buffer + actual_size, 0, SIMMEMSIZE - actual_size);
+      printf("Info: no offset specified, simulated data starts at %lXh\n", *min);
+      memset(buffer + actual_size, 0, window_size - actual_size);
    }
    return actual_size;
 }
@@ -10,23 +10,28 @@
 static const char* errmsg = "Error in S-Record file: ";
 
 int
-parse_srec(FILE *file, uint8_t *buffer, int *min, int *max, long offset)
+parse_srec(FILE *file, uint8_t *buffer, long *min, long *max, long offset,
+      struct Coverage *coverage)
 {
    int ch;
    *max = 0;
-   *min = INT_MAX;
+   *min = LONG_MAX;
    int actual_size = 0;
    int bytes_ignored = 0;
    long records = 0;
    char header[255];
-   int v;
+   long long v;
    int i;
    char expected_termination = 0;
    int type;
    int count;
-   int addr;
+   long addr;
+   long idx;
    int check;
    int expected_number_of_records = -1;
+   struct Window window;
+
+   window_init(&window, offset, coverage);
 
    skip_white(file);
    while (!feof(file))
@@ -98,6 +103,19 @@ parse_srec(FILE *file, uint8_t *buffer, int *min, int *max, long offset)
             addr = v;
             expected_termination = '0' + (9 - (type - '0') + 1);
             // printf("S%c --> S%c\n", type, expected_termination);
+            idx = window_index(&window, buffer, addr, count - 1);
+            if (idx + count - 1 <= 0 || idx >= window_size)
+            {
+               // Whole record outside of window, only check the data
+               if (skip_hex(file, count - 1, &check) < 0)
+               {
+                  fprintf(stderr, "%s: illegal character in S%c data field\n", errmsg, type);
+                  return -1;
+               }
+               bytes_ignored += count - 1;
+               break;
+            }
+            if (idx >= 0) stream_record(idx);
             for (i = 0; i < count - 1; i++)
             {
                v = get_hex2(file, &check);
@@ -106,15 +124,19 @@ parse_srec(FILE *file, uint8_t *buffer, int *min, int *max, long offset)
                   fprintf(stderr, "%s: illegal character in S%c data field\n", errmsg, type);
                   return v;
                }
-               if ((addr - offset) >= 0)
-                  buffer[addr - offset] = v;
+               if (idx >= 0 && idx < window_size)
+               {
+                  buffer[idx] = v;
+                  if (coverage) coverage->map[idx] = 1;
+                  if (addr > *max) *max = addr;
+                  if (addr < *min) *min = addr;
+               }
                else
                   bytes_ignored++;
-               if (addr > *max) *max = addr;
-               if (addr < *min) *min = addr;
-               actual_size = *max - *min + 1;
                addr++;
+               idx++;
             }
+            actual_size = *max - *min + 1;
             break;
          case '5':         // S5 16 bit record counter
          case '6':         // S6 24 bit record counter
@@ -122,7 +144,7 @@ parse_srec(FILE *file, uint8_t *buffer, int *min, int *max, long offset)
             break;
          default:
             // everything else handled earlier, so this is S7, S8 or S9
-            printf("Info: S%c start address 0x%X\n", type, v);
+            printf("Info: S%c start address 0x%llX\n", type, v);
             if (type != expected_termination)
             {
                fprintf(stderr, "Warning: expected S%c but found S%c\n", expected_termination, type);
@@ -154,13 +176,18 @@ parse_srec(FILE *file, uint8_t *buffer, int *min, int *max, long offset)
       ignore_rest_of_line(file);
    }
 
-   printf("Info: Intel hex data from %04Xh - %04Xh = %d bytes\n", *min, *max, actual_size);
+   if (actual_size == 0) *min = 0;
+   printf("Info: Intel hex data from %04lXh - %04lXh = %d bytes\n", *min, *max, actual_size);
    if (bytes_ignored) printf("Info: %d bytes outside storage area ignored\n", bytes_ignored);
+   if (coverage)
+   {
+      coverage->base = window.base;
+      coverage->ignored = bytes_ignored;
+   }
    if (!offset_given)
    {
-      printf("Info: no offset specified, simulated data starts at %Xh\n", *min);
-      memmove(buffer, buffer + *min, actual_size);
-      memset(buffer + actual_size, 0, SIMMEMSIZE - actual_size);
+      printf("Info: no offset specified, simulated data starts at %lXh\n", *min);
+      memset(buffer + actual_size, 0, window_size - actual_size);
    }
    return actual_size;
 }
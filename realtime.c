@@ -0,0 +1,161 @@
+#define _GNU_SOURCE             // sched_setaffinity()
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "memsim2.h"
+
+// Scheduling of the transfer on loaded hosts: a real-time policy or, if
+// that isn't permitted, a lower nice value, the image locked in memory
+// and the process pinned to one CPU. Everything is optional and falls
+// back to normal operation with a note. The duration of each write() can
+// be recorded to see stalls of the transfer.
+
+#define RT_PRIORITY 10          // above all normal processes, below kernel threads
+#define NICE_VALUE -10
+#define MAX_STALL_SAMPLES 8192
+
+static struct
+{
+   bool active;
+   int policy;
+   struct sched_param param;
+   int nice;
+   bool pinned;
+   cpu_set_t cpus;
+   const void *locked;
+   size_t locked_size;
+} saved;
+
+static struct
+{
+   bool enabled;
+   pthread_mutex_t lock;
+   double *samples;
+   int count;
+} stalls = { false, PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+// Parse the POLICY of --realtime, NULL for the default
+int
+realtime_policy(const char *name)
+{
+   if (!name || !strcmp(name, "fifo")) return SCHED_FIFO;
+   if (!strcmp(name, "rr")) return SCHED_RR;
+   fprintf(stderr, "Error: Unknown scheduling policy '%s', use fifo or rr\n", name);
+   return -1;
+}
+
+// Prepare the transfer: policy < 0 keeps the scheduling, cpu < 0 the CPUs.
+// buffer is locked in memory if it is not NULL.
+void
+realtime_begin(int policy, int cpu, const void *buffer, size_t size)
+{
+   saved.active = true;
+   saved.policy = sched_getscheduler(0);
+   sched_getparam(0, &saved.param);
+   errno = 0;
+   saved.nice = getpriority(PRIO_PROCESS, 0);
+   saved.locked = NULL;
+   saved.pinned = false;
+
+   if (cpu >= 0)
+   {
+      cpu_set_t set;
+
+      if (sched_getaffinity(0, sizeof(saved.cpus), &saved.cpus) < 0)
+         CPU_ZERO(&saved.cpus);
+
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if (sched_setaffinity(0, sizeof(set), &set) < 0)
+         printf("Info: can't pin transfer to CPU %d: %s\n", cpu, strerror(errno));
+      else
+      {
+         saved.pinned = CPU_COUNT(&saved.cpus) > 0;
+         printf("Info: transfer pinned to CPU %d\n", cpu);
+      }
+   }
+   if (policy >= 0)
+   {
+      struct sched_param param = { .sched_priority = RT_PRIORITY };
+
+      if (sched_setscheduler(0, policy, &param) == 0)
+         printf("Info: transfer runs with %s priority %d\n",
+               policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", RT_PRIORITY);
+      else
+      {
+         int err = errno;
+
+         if (setpriority(PRIO_PROCESS, 0, NICE_VALUE) == 0)
+            printf("Info: real-time scheduling not permitted (%s), running with nice %d\n",
+                  strerror(err), NICE_VALUE);
+         else
+            printf("Info: real-time scheduling and nice %d not permitted (%s), "
+                  "needs CAP_SYS_NICE or RLIMIT_RTPRIO\n", NICE_VALUE, strerror(err));
+      }
+   }
+   if (buffer)
+   {
+      if (mlock(buffer, size) == 0)
+      {
+         saved.locked = buffer;
+         saved.locked_size = size;
+      }
+      else
+         printf("Info: can't lock image in memory (%s), see RLIMIT_MEMLOCK\n", strerror(errno));
+   }
+}
+
+// Back to the scheduling and CPUs before realtime_begin()
+void
+realtime_end(void)
+{
+   if (!saved.active) return;
+   if (saved.pinned) sched_setaffinity(0, sizeof(saved.cpus), &saved.cpus);
+   sched_setscheduler(0, saved.policy, &saved.param);
+   if (saved.policy == SCHED_OTHER) setpriority(PRIO_PROCESS, 0, saved.nice);
+   if (saved.locked) munlock(saved.locked, saved.locked_size);
+   saved.active = false;
+}
+
+void
+stalls_enable(void)
+{
+   stalls.samples = malloc(MAX_STALL_SAMPLES * sizeof(*stalls.samples));
+   stalls.enabled = stalls.samples != NULL;
+}
+
+// Record the duration of one write(), called by the lane threads as well
+void
+stalls_record(double seconds)
+{
+   if (!stalls.enabled) return;
+   pthread_mutex_lock(&stalls.lock);
+   if (stalls.count < MAX_STALL_SAMPLES) stalls.samples[stalls.count++] = seconds;
+   pthread_mutex_unlock(&stalls.lock);
+}
+
+void
+stalls_report(void)
+{
+   if (!stalls.enabled) return;
+   if (stalls.count == 0)
+   {
+      printf("Info: no write() calls recorded\n");
+      return;
+   }
+   stats_sort(stalls.samples, stalls.count);
+   printf("Info: %d writes, duration p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+         stalls.count, stats_percentile(stalls.samples, stalls.count, 50) * 1e3,
+         stats_percentile(stalls.samples, stalls.count, 90) * 1e3,
+         stats_percentile(stalls.samples, stalls.count, 99) * 1e3,
+         stalls.samples[stalls.count - 1] * 1e3);
+}
@@ -0,0 +1,214 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "memsim2.h"
+
+// Address and data line scrambling described by a board profile.
+//
+// A board profile is a small text file, '#' starts a comment:
+//
+//    # EPROM pin  A0 A1 A2 ...
+//    address      0  1  2  3  4  5  6  7  8  9  10 12 11
+//    # EPROM pin  D0 D1 ...
+//    data         7  6  5  4  3  2  1  0
+//
+// The n-th number of the address line tells which CPU address line is
+// wired to EPROM pin An, the data line does the same for EPROM pin Dn.
+// EPROM address lines not listed are assumed to be wired straight.
+//
+// The byte the CPU expects at address X is stored at the EPROM address
+// whose bit n equals bit address[n] of X, with its data bits permuted
+// the same way. Address permutation is linear, so it is done with two
+// lookup tables for the lower and upper address bits.
+
+#define ADDR_BITS   19          // SIMMEMSIZE = 2^19
+#define LOW_BITS    10
+
+static bool profile_loaded;
+static int addr_bits;
+static int addr_map[ADDR_BITS];
+static uint8_t data_lut[256];
+static uint32_t low_lut[1 << LOW_BITS];
+static uint32_t high_lut[1 << (ADDR_BITS - LOW_BITS)];
+
+static const char *errmsg = "Error in board profile: ";
+
+static int
+parse_lines(char *list, int *map, int max, int line)
+{
+   bool seen[ADDR_BITS] = { false };
+   char *tok;
+   int n = 0;
+
+   for (tok = strtok(list, " \t,"); tok; tok = strtok(NULL, " \t,"))
+   {
+      char *endptr;
+      long v;
+
+      if (toupper((unsigned char)*tok) == 'A' || toupper((unsigned char)*tok) == 'D') tok++;
+      v = strtol(tok, &endptr, 10);
+      if (*endptr != '\0' || v < 0 || v >= max)
+      {
+         fprintf(stderr, "%sline %d: illegal line number '%s'\n", errmsg, line, tok);
+         return -1;
+      }
+      if (n == max)
+      {
+         fprintf(stderr, "%sline %d: more than %d lines\n", errmsg, line, max);
+         return -1;
+      }
+      if (seen[v])
+      {
+         fprintf(stderr, "%sline %d: line %ld used twice\n", errmsg, line, v);
+         return -1;
+      }
+      seen[v] = true;
+      map[n++] = v;
+   }
+   return n;
+}
+
+int
+scramble_load(const char *filename)
+{
+   char line[256];
+   int data_map[8];
+   int data_bits = 0;
+   int number = 0;
+   int v, i;
+   FILE *file = fopen(filename, "r");
+
+   if (!file)
+   {
+      fprintf(stderr, "Error: Failed to open board profile '%s': %s\n",
+            filename, strerror(errno));
+      return -1;
+   }
+   addr_bits = 0;
+   while (fgets(line, sizeof(line), file))
+   {
+      char *p = strchr(line, '#');
+      char *key;
+
+      number++;
+      if (p) *p = '\0';
+      key = strtok(line, " \t\r\n");
+      if (!key) continue;
+      p = strtok(NULL, "\r\n");
+      if (!p) p = "";
+      if (!strcasecmp(key, "address"))
+         addr_bits = parse_lines(p, addr_map, ADDR_BITS, number);
+      else if (!strcasecmp(key, "data"))
+         data_bits = parse_lines(p, data_map, 8, number);
+      else
+      {
+         fprintf(stderr, "%sline %d: unknown keyword '%s'\n", errmsg, number, key);
+         addr_bits = -1;
+      }
+      if (addr_bits < 0 || data_bits < 0)
+      {
+         fclose(file);
+         return -1;
+      }
+   }
+   fclose(file);
+   if (data_bits != 0 && data_bits != 8)
+   {
+      fprintf(stderr, "%sdata needs all 8 lines\n", errmsg);
+      return -1;
+   }
+   for (i = 0; i < addr_bits; i++)
+   {
+      if (addr_map[i] >= addr_bits)
+      {
+         fprintf(stderr, "%saddress lines must be a permutation of 0..%d\n", errmsg, addr_bits - 1);
+         return -1;
+      }
+   }
+   // Unlisted EPROM address lines are wired straight
+   for (i = addr_bits; i < ADDR_BITS; i++) addr_map[i] = i;
+
+   for (v = 0; v < 256; v++)
+   {
+      data_lut[v] = v;
+      if (data_bits == 8)
+      {
+         data_lut[v] = 0;
+         for (i = 0; i < 8; i++)
+            data_lut[v] |= ((v >> data_map[i]) & 1) << i;
+      }
+   }
+   for (v = 0; v < (1 << LOW_BITS); v++)
+   {
+      low_lut[v] = 0;
+      for (i = 0; i < ADDR_BITS; i++)
+         if (addr_map[i] < LOW_BITS)
+            low_lut[v] |= (uint32_t)((v >> addr_map[i]) & 1) << i;
+   }
+   for (v = 0; v < (1 << (ADDR_BITS - LOW_BITS)); v++)
+   {
+      high_lut[v] = 0;
+      for (i = 0; i < ADDR_BITS; i++)
+         if (addr_map[i] >= LOW_BITS)
+            high_lut[v] |= (uint32_t)((v >> (addr_map[i] - LOW_BITS)) & 1) << i;
+   }
+   printf("Info: board profile %s: %d address lines, %s data lines\n",
+         filename, addr_bits, data_bits ? "8" : "straight");
+   profile_loaded = true;
+   return 0;
+}
+
+bool
+scramble_active(void)
+{
+   return profile_loaded;
+}
+
+// True if a chip of size bytes can be scrambled: the permuted address
+// lines must span whole blocks of the chip, otherwise bytes of the last
+// partial block would be moved beyond its end
+bool
+scramble_fits(int size)
+{
+   return !profile_loaded || (size > 0 && size % (1 << addr_bits) == 0);
+}
+
+// Scramble size bytes of buffer in place, size must be a multiple of
+// 2^addr_bits
+int
+scramble_apply(uint8_t *buffer, int size)
+{
+   struct timespec start, end;
+   uint8_t *tmp;
+   uint32_t x;
+
+   if (!profile_loaded) return 0;
+   if (!scramble_fits(size))
+   {
+      fprintf(stderr, "Error: board profile with %d address lines needs a multiple of %d bytes, chip has %d bytes\n",
+            addr_bits, 1 << addr_bits, size);
+      return -1;
+   }
+   tmp = malloc(size);
+   if (!tmp)
+   {
+      perror("Error: Failed to allocate scramble buffer");
+      return -1;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (x = 0; x < (uint32_t)size; x++)
+      tmp[low_lut[x & ((1 << LOW_BITS) - 1)] | high_lut[x >> LOW_BITS]] = data_lut[buffer[x]];
+   memcpy(buffer, tmp, size);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   free(tmp);
+   printf("Info: %d bytes scrambled in %.2f ms\n", size,
+         (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+   return 0;
+}
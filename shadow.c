@@ -0,0 +1,295 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "memsim2.h"
+
+// Shadow copy of the image last acknowledged by a device, kept in a
+// memory mapped file per device. Before an upload the new image is
+// compared with it: unchanged images are not sent again, otherwise the
+// changed ranges are reported. The memSIM2 protocol has no partial
+// write, so changed images are always sent completely.
+//
+// A shadow file is a header page followed by SIMMEMSIZE bytes of image,
+// only the pages used are allocated on disk.
+//
+// Shadows belong to a USB device, found from the tty in sysfs, not to a
+// device path. A simulator loses its memory when it is powered off, which
+// for the USB powered memSIM2 means unplugged. The bus and device number
+// change whenever a device is plugged in, so together with the boot id
+// they tell if the simulator still holds the image. Without a USB
+// identity changes are reported, but the image is always sent.
+
+#define SHADOW_MAGIC "MSSHADW2"
+#define HEADER_PAGE 4096
+#define SHADOW_SIZE (HEADER_PAGE + SIMMEMSIZE)
+#define BLOCK_SIZE 1024         // unit of the simulator's data command
+#define MAX_RANGES_SHOWN 8
+
+struct ShadowHeader
+{
+   char magic[8];
+   int32_t valid;       // image was acknowledged by the device
+   int32_t size;
+   char config[MEMSIM_CMD_SIZE];
+   char session[96];    // boot id, bus and device number at the upload
+};
+
+static struct ShadowHeader *header;
+static uint8_t *shadow;
+static char session[96];        // of the device now, empty if unknown
+
+static int
+make_dir(const char *path)
+{
+   if (mkdir(path, 0755) < 0 && errno != EEXIST)
+   {
+      fprintf(stderr, "Error: Failed to create '%s': %s\n", path, strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+// Read the first line of file name in dir into buf, false if missing or empty
+static bool
+read_line(const char *dir, const char *name, char *buf, size_t size)
+{
+   char path[PATH_MAX];
+   FILE *file;
+   bool ok;
+
+   snprintf(path, sizeof(path), "%s/%s", dir, name);
+   file = fopen(path, "r");
+   if (!file) return false;
+   ok = fgets(buf, size, file) != NULL;
+   fclose(file);
+   if (!ok) return false;
+   buf[strcspn(buf, "\n")] = '\0';
+   return *buf != '\0';
+}
+
+// Name of the USB device behind tty device from vendor, product and serial
+// number in name, and its plug-in session in session. Returns false if it
+// isn't a USB device with a serial number.
+static bool
+usb_identity(const char *device, char *name, size_t name_size)
+{
+   char path[PATH_MAX];
+   char sys[PATH_MAX];
+   char vendor[16], product[16], serial[128];
+   char busnum[16], devnum[16], boot[48];
+   char tty[NAME_MAX + 1];
+   char *slash;
+
+   if (!realpath(device, path)) return false;
+   snprintf(tty, sizeof(tty), "%s", strrchr(path, '/') + 1);
+   snprintf(sys, sizeof(sys), "/sys/class/tty/%s/device", tty);
+   if (!realpath(sys, path)) return false;
+   // The tty belongs to an interface, the device is the first parent with a vendor
+   while (!read_line(path, "idVendor", vendor, sizeof(vendor)))
+   {
+      slash = strrchr(path, '/');
+      if (!slash || slash == path) return false;
+      *slash = '\0';
+   }
+   if (!read_line(path, "idProduct", product, sizeof(product)) ||
+       !read_line(path, "serial", serial, sizeof(serial)) ||
+       !read_line(path, "busnum", busnum, sizeof(busnum)) ||
+       !read_line(path, "devnum", devnum, sizeof(devnum)))
+      return false;
+   if (!read_line("/proc/sys/kernel/random", "boot_id", boot, sizeof(boot))) *boot = '\0';
+   snprintf(name, name_size, "usb-%s-%s-%s", vendor, product, serial);
+   snprintf(session, sizeof(session), "%s %s-%s", boot, busnum, devnum);
+   return true;
+}
+
+// Open the shadow file for device in dir, NULL for the default directory
+int
+shadow_open(const char *dir, const char *device)
+{
+   char path[4096];
+   char id[256];
+   char name[256];
+   size_t len;
+   void *map;
+   int fd;
+   int i;
+
+   if (!dir)
+   {
+      const char *cache = getenv("XDG_CACHE_HOME");
+      const char *home = getenv("HOME");
+
+      if (cache && *cache)
+         snprintf(path, sizeof(path), "%s", cache);
+      else
+         snprintf(path, sizeof(path), "%s/.cache", home ? home : ".");
+      if (make_dir(path) < 0) return -1;
+      len = strlen(path);
+      snprintf(path + len, sizeof(path) - len, "/memsim2");
+   }
+   else
+      snprintf(path, sizeof(path), "%s", dir);
+   if (make_dir(path) < 0) return -1;
+
+   // One file per simulator, named after its USB identity or the device path
+   *session = '\0';
+   if (!usb_identity(device, id, sizeof(id)))
+   {
+      printf("Info: %s has no USB serial number, unchanged images are sent anyway\n", device);
+      snprintf(id, sizeof(id), "%s", device);
+   }
+   for (i = 0; id[i] && i < (int)sizeof(name) - 1; i++)
+      name[i] = (isalnum((unsigned char)id[i]) || strchr("-._", id[i])) ? id[i] : '_';
+   name[i] = '\0';
+   len = strlen(path);
+   snprintf(path + len, sizeof(path) - len, "/%s.shadow", name);
+
+   fd = open(path, O_RDWR | O_CREAT, 0644);
+   if (fd < 0 || ftruncate(fd, SHADOW_SIZE) < 0)
+   {
+      fprintf(stderr, "Error: Failed to open shadow file '%s': %s\n", path, strerror(errno));
+      if (fd >= 0) close(fd);
+      return -1;
+   }
+   map = mmap(NULL, SHADOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+   {
+      perror("Error: Failed to map shadow file");
+      return -1;
+   }
+   header = map;
+   shadow = (uint8_t *)map + HEADER_PAGE;
+   if (memcmp(header->magic, SHADOW_MAGIC, sizeof(header->magic)))
+   {
+      memset(header, 0, sizeof(*header));
+      memcpy(header->magic, SHADOW_MAGIC, sizeof(header->magic));
+   }
+   return 0;
+}
+
+// Returns a 16 bit mask of the bytes that differ in a 16 byte chunk
+static unsigned int
+diff_mask(const uint8_t *a, const uint8_t *b)
+{
+#if defined(__SSE2__)
+   __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),
+         _mm_loadu_si128((const __m128i *)b));
+
+   return ~_mm_movemask_epi8(eq) & 0xFFFF;
+#else
+   unsigned int mask = 0;
+   int i;
+
+   for (i = 0; i < 16; i++)
+      if (a[i] != b[i]) mask |= 1u << i;
+   return mask;
+#endif
+}
+
+// Forget the shadow before an upload, it is incomplete if the upload fails
+void
+shadow_invalidate(void)
+{
+   if (!header) return;
+   header->valid = 0;
+   msync(header, HEADER_PAGE, MS_SYNC);
+}
+
+// Compare size bytes of mem with the shadow and print the changed ranges.
+// Returns 1 if the device already holds exactly this image, otherwise the
+// shadow is invalidated, as the upload replaces the device's memory.
+int
+shadow_compare(const struct EmuConfig *config, const uint8_t *mem, int size)
+{
+   char emu_cmd[MEMSIM_CMD_SIZE];
+   long changed = 0;
+   int ranges = 0;
+   int blocks = 0;
+   int range_start = -1;
+   int last_block = -1;
+   int i;
+
+   if (!header) return 0;
+   memsim_config_cmd(config, emu_cmd);
+   if (!header->valid || header->size != size)
+   {
+      printf("Info: no previous image of this size known for the device\n");
+      shadow_invalidate();
+      return 0;
+   }
+   if (*session && strcmp(header->session, session))
+   {
+      printf("Info: the simulator was plugged in since the last upload\n");
+      shadow_invalidate();
+      return 0;
+   }
+   // Chunks of 16 bytes, size is a multiple of 1 KB
+   for (i = 0; i < size; i += 16)
+   {
+      unsigned int mask = diff_mask(mem + i, shadow + i);
+
+      if (!mask) continue;
+      changed += __builtin_popcount(mask);
+      if (i / BLOCK_SIZE != last_block)
+      {
+         blocks++;
+         last_block = i / BLOCK_SIZE;
+      }
+      if (range_start < 0) range_start = i + __builtin_ctz(mask);
+      // A range ends before the next unchanged chunk
+      if (i + 16 >= size || !diff_mask(mem + i + 16, shadow + i + 16))
+      {
+         if (ranges < MAX_RANGES_SHOWN)
+            printf("%s %04Xh-%04Xh", ranges ? "" : "Info: changed", range_start,
+                  i + 31 - __builtin_clz(mask));
+         else if (ranges == MAX_RANGES_SHOWN)
+            printf(" ...");
+         ranges++;
+         range_start = -1;
+      }
+   }
+   if (ranges) printf("\n");
+
+   if (!changed && !strcmp(header->config, emu_cmd) && *session)
+   {
+      printf("Info: device already holds this image, upload skipped\n");
+      return 1;
+   }
+   shadow_invalidate();
+   if (!changed && !*session)
+      printf("Info: image unchanged\n");
+   else if (!changed)
+      printf("Info: image unchanged, configuration changed\n");
+   else
+      printf("Info: %ld bytes changed in %d ranges, a partial upload would send %d of %d KB (%d%% less)\n",
+            changed, ranges, blocks, size / BLOCK_SIZE, 100 - 100 * blocks / (size / BLOCK_SIZE));
+   return 0;
+}
+
+// Remember an image acknowledged by the device
+void
+shadow_store(const struct EmuConfig *config, const uint8_t *mem, int size)
+{
+   if (!header) return;
+   memcpy(shadow, mem, size);
+   header->size = size;
+   memsim_config_cmd(config, header->config);
+   memcpy(header->session, session, sizeof(header->session));
+   msync(shadow, size, MS_SYNC);
+   header->valid = 1;
+   msync(header, HEADER_PAGE, MS_SYNC);
+}
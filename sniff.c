@@ -0,0 +1,104 @@
+#define _GNU_SOURCE             // fopencookie()
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "memsim2.h"
+
+// Detection of the image format from the first block of a file without a
+// known suffix. The block is handed to the parser in front of the rest of
+// the file, so pipes from decompressors can be detected as well.
+
+// Returns the format of the data starting with block
+enum ImageFormat
+sniff_format(const uint8_t *block, size_t size)
+{
+   size_t i = 0;
+
+   if (size >= 4 && !memcmp(block, "\x7F" "ELF", 4)) return FORMAT_ELF;
+   while (i < size && isspace(block[i])) i++;
+   if (i + 3 > size) return FORMAT_BINARY;
+   if (block[i] == ':' && isxdigit(block[i + 1]) && isxdigit(block[i + 2]))
+      return FORMAT_IHEX;
+   if (block[i] == 'S' && isdigit(block[i + 1]) && isxdigit(block[i + 2]))
+      return FORMAT_SREC;
+   return FORMAT_BINARY;
+}
+
+struct Prefix
+{
+   FILE *file;
+   uint8_t block[SNIFF_SIZE];
+   size_t size;
+   size_t pos;
+};
+
+static ssize_t
+prefix_read(void *cookie, char *buf, size_t count)
+{
+   struct Prefix *p = cookie;
+
+   if (p->pos < p->size)
+   {
+      size_t n = (p->size - p->pos < count) ? p->size - p->pos : count;
+
+      memcpy(buf, p->block + p->pos, n);
+      p->pos += n;
+      return n;
+   }
+   count = fread(buf, 1, count, p->file);
+   return (count == 0 && ferror(p->file)) ? -1 : (ssize_t)count;
+}
+
+// Closes only the stream, the underlying file stays open
+static int
+prefix_close(void *cookie)
+{
+   free(cookie);
+   return 0;
+}
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+static int
+prefix_read_bsd(void *cookie, char *buf, int count)
+{
+   return prefix_read(cookie, buf, count);
+}
+#endif
+
+// Returns a stream reading the block followed by the rest of file
+FILE *
+prefix_file(FILE *file, const uint8_t *block, size_t size)
+{
+   struct Prefix *p;
+   FILE *stream = NULL;
+
+   p = malloc(sizeof(*p));
+   if (!p) return NULL;
+   p->file = file;
+   memcpy(p->block, block, size);
+   p->size = size;
+   p->pos = 0;
+#if defined(__GLIBC__)
+   {
+      cookie_io_functions_t functions = { prefix_read, NULL, NULL, prefix_close };
+
+      stream = fopencookie(p, "rb", functions);
+   }
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+   stream = funopen(p, prefix_read_bsd, NULL, NULL, prefix_close);
+#else
+   // No custom streams, read the block again if the file can seek
+   free(p);
+   p = NULL;
+   if (fseek(file, 0L, SEEK_SET) == 0) return file;
+   fprintf(stderr, "Error: Format of compressed files without suffix can't be detected\n");
+#endif
+   if (!stream) free(p);
+   return stream;
+}
@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "memsim2.h"
+
+// Pipelined transfer: a producer thread parses the image while the
+// transmitter sends every chunk as soon as all bytes below its end are
+// final. Parsers announce the start address of each record they store
+// with stream_record(). For address-ordered input everything below that
+// address is final. A record below the announced address means the input
+// is not ordered, in that case the watermark is frozen and the image is
+// sent again in buffered mode once parsing has completed.
+
+#define CHUNK_SIZE 512
+
+struct Stream
+{
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   const char *filename;
+   uint8_t *mem;
+   long offset;
+   int size;            // image size without mirroring
+   int final;           // all bytes below this address are final
+   bool done;
+   bool out_of_order;
+   int result;          // return value of read_image()
+};
+
+static struct Stream *active;
+
+void
+stream_record(long addr)
+{
+   struct Stream *s = active;
+
+   if (!s) return;
+   pthread_mutex_lock(&s->lock);
+   if (addr < s->final)
+   {
+      if (!s->out_of_order)
+         printf("Info: records not ordered by address, image will be sent again\n");
+      s->out_of_order = true;
+   }
+   else if (!s->out_of_order)
+   {
+      s->final = (addr < s->size) ? addr : s->size;
+      pthread_cond_signal(&s->cond);
+   }
+   pthread_mutex_unlock(&s->lock);
+}
+
+static void *
+producer(void *arg)
+{
+   struct Stream *s = arg;
+   long min, max;
+   int res;
+
+   res = read_image(s->filename, s->mem, s->offset, &min, &max, NULL);
+   pthread_mutex_lock(&s->lock);
+   s->result = res;
+   s->final = s->size;
+   s->done = true;
+   pthread_cond_signal(&s->cond);
+   pthread_mutex_unlock(&s->lock);
+   return NULL;
+}
+
+static int
+send_portion(int fd, const uint8_t *mem, int *sent, int end, int total, int divider)
+{
+   while (*sent < end)
+   {
+      int portion = end - *sent;
+
+      if (portion > CHUNK_SIZE) portion = CHUNK_SIZE;
+      if (write_all(fd, mem + *sent, portion, 0, 0) < 0)
+      {
+         printf("\n");
+         perror("Error: Failed to write data");
+         return -1;
+      }
+      *sent += portion;
+      print_progress(*sent / divider, total / divider);
+   }
+   return 0;
+}
+
+// Returns the detected image size like read_image() or -1 on error
+int
+stream_upload(int fd, const char *filename, uint8_t *mem, long offset,
+      const struct MemType *mem_type)
+{
+   struct Stream s;
+   pthread_t thread;
+   char emu_cmd[MEMSIM_CMD_SIZE];
+   int sim_size = mem_type->size;
+   // Small chips are mirrored, see mirror_small_image()
+   int total = chip_send_size(mem_type);
+   int divider = (total % sim_size == 0) ? total / sim_size : 1;
+   int sent = 0;
+   bool sent_early = false;
+   bool threaded = true;
+   bool header_sent = false;
+   bool write_failed = false;
+   int res = 0;
+
+   memset(&s, 0, sizeof(s));
+   pthread_mutex_init(&s.lock, NULL);
+   pthread_cond_init(&s.cond, NULL);
+   s.filename = filename;
+   s.mem = mem;
+   s.offset = offset;
+   s.size = sim_size;
+
+   active = &s;
+   if (pthread_create(&thread, NULL, producer, &s) != 0)
+   {
+      // No thread, no overlap: parse first, then send everything
+      threaded = false;
+      producer(&s);
+   }
+
+   while (res == 0 && sent < sim_size)
+   {
+      int end;
+
+      pthread_mutex_lock(&s.lock);
+      while (!s.done && s.final - sent < CHUNK_SIZE)
+         pthread_cond_wait(&s.cond, &s.lock);
+      if (s.done && s.result < 0)
+      {
+         pthread_mutex_unlock(&s.lock);
+         res = -1;
+         break;
+      }
+      if (!s.done) sent_early = true;
+      end = s.final;
+      pthread_mutex_unlock(&s.lock);
+
+      if (!header_sent)
+      {
+         res = memsim_data_begin(fd, total, emu_cmd);
+         if (res < 0) break;
+         header_sent = true;
+      }
+      res = send_portion(fd, mem, &sent, end, total, divider);
+      if (res < 0) write_failed = true;
+   }
+
+   if (threaded) pthread_join(thread, NULL);
+   active = NULL;
+   pthread_cond_destroy(&s.cond);
+   pthread_mutex_destroy(&s.lock);
+
+   // The size is only known after parsing, check it before the transfer ends
+   if (res == 0 && s.result < 0)
+      res = -1;
+   else if (res == 0 && s.result > sim_size)
+   {
+      printf("\n");
+      fprintf(stderr, "Too much data (%d bytes) for specified memory type (%d bytes)\n",
+            s.result, sim_size);
+      res = -1;
+   }
+   if (res < 0)
+   {
+      // The simulator waits for all bytes announced by the data command,
+      // complete the transfer so it accepts the next command
+      if (header_sent && !write_failed &&
+          send_portion(fd, mem, &sent, total, total, divider) == 0)
+      {
+         printf("\n");
+         memsim_data_end(fd, emu_cmd);
+      }
+      if (sent > 0)
+         fprintf(stderr, "Error: transfer aborted, emulator contents are incomplete\n");
+      return -1;
+   }
+
+   if (!header_sent && memsim_data_begin(fd, total, emu_cmd) < 0) return -1;
+   mirror_small_image(mem, mem_type, &sim_size);
+   if (send_portion(fd, mem, &sent, total, total, divider) < 0) return -1;
+   if (memsim_data_end(fd, emu_cmd) < 0) return -1;
+
+   if (s.out_of_order && sent_early)
+   {
+      printf("\n");
+      if (memsim_upload(fd, mem, total, true, divider) < 0) return -1;
+   }
+   return s.result;
+}
@@ -0,0 +1,302 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "memsim2.h"
+
+// io_uring transfer engine for the data phase, built with make URING=y.
+// The data header, the image and the read of the reply are submitted as
+// one chain of linked requests, the reply read with a linked timeout, so
+// a whole upload takes a few system calls instead of one write() per
+// 512 bytes. The image is split into a few writes only to drive the
+// progress bar. The ring is set up with raw system calls, liburing is
+// not needed.
+
+#ifdef USE_URING
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 32
+#define DATA_WRITES 16          // writes per image, steps of the progress bar
+
+struct Ring
+{
+   int fd;
+   unsigned *sq_head;
+   unsigned *sq_tail;
+   unsigned *sq_mask;
+   unsigned *sq_array;
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned *cq_mask;
+   struct io_uring_sqe *sqes;
+   struct io_uring_cqe *cqes;
+   void *sq_map;
+   void *cq_map;
+   size_t sq_size;
+   size_t cq_size;
+   size_t sqes_size;
+};
+
+// Returns -1 with errno set if io_uring can't be used
+static int
+ring_setup(struct Ring *ring)
+{
+   struct io_uring_params p;
+   uint8_t *sq;
+   uint8_t *cq;
+
+   memset(&p, 0, sizeof(p));
+   memset(ring, 0, sizeof(*ring));
+   stats_syscalls(1);
+   ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+   if (ring->fd < 0) return -1;
+   ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+      ring->cq_size = ring->sq_size;
+   }
+   ring->sq_map = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+         ring->fd, IORING_OFF_SQ_RING);
+   ring->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_map :
+      mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_CQ_RING);
+   ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+         ring->fd, IORING_OFF_SQES);
+   stats_syscalls(3);
+   if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+   {
+      close(ring->fd);
+      return -1;
+   }
+   sq = ring->sq_map;
+   cq = ring->cq_map;
+   ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+   ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+   ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+   ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+   ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+   ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+   ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+   return 0;
+}
+
+static void
+ring_close(struct Ring *ring)
+{
+   munmap(ring->sqes, ring->sqes_size);
+   if (ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_size);
+   munmap(ring->sq_map, ring->sq_size);
+   close(ring->fd);
+}
+
+static struct io_uring_sqe *
+ring_prep(struct Ring *ring, int opcode, int fd, const void *buffer, unsigned len,
+      unsigned flags, uint64_t user_data)
+{
+   unsigned tail = *ring->sq_tail;
+   unsigned index = tail & *ring->sq_mask;
+   struct io_uring_sqe *sqe = &ring->sqes[index];
+
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->opcode = opcode;
+   sqe->fd = fd;
+   sqe->addr = (uintptr_t)buffer;
+   sqe->len = len;
+   // Reads and writes at the current position, serial devices can't seek
+   sqe->off = (opcode == IORING_OP_READ || opcode == IORING_OP_WRITE) ? (uint64_t)-1 : 0;
+   sqe->flags = flags;
+   sqe->user_data = user_data;
+   ring->sq_array[index] = index;
+   __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+   return sqe;
+}
+
+// Copies the next completion to cqe, returns false if there is none
+static bool
+ring_reap(struct Ring *ring, struct io_uring_cqe *cqe)
+{
+   unsigned head = *ring->cq_head;
+
+   if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return false;
+   *cqe = ring->cqes[head & *ring->cq_mask];
+   __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+   return true;
+}
+
+static int
+ring_enter(struct Ring *ring, unsigned submit, unsigned wait)
+{
+   int res;
+
+   stats_syscalls(1);
+   do
+      res = syscall(__NR_io_uring_enter, ring->fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+   while (res < 0 && errno == EINTR);
+   return res;
+}
+
+enum { ID_HEADER = 0, ID_POLL = DATA_WRITES + 1, ID_TIMEOUT, ID_REPLY };
+
+int
+uring_upload(int fd, const char *emu_cmd, const uint8_t *data, int size, char *reply,
+      int timeout, bool progress, int divider)
+{
+   struct __kernel_timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+   int done[ID_REPLY + 1] = { 0 };
+   int length[ID_REPLY + 1] = { 0 };
+   double start = stats_now();
+   double data_done = 0;
+   struct Ring ring;
+   struct io_uring_cqe cqe;
+   int chunk = (size + DATA_WRITES - 1) / DATA_WRITES;
+   int chunks = 0;
+   int pending;
+   int written = 0;
+   int i;
+
+   if (ring_setup(&ring) < 0)
+   {
+      printf("Info: io_uring not available (%s), using write()\n", strerror(errno));
+      return URING_UNAVAILABLE;
+   }
+
+   // Header, image and reply read are linked, each starts when the
+   // previous one has completed. Writes run in a kernel worker, which
+   // blocks until all bytes are accepted by the serial driver. A read in
+   // the worker would block as well and couldn't be cancelled, so the
+   // timeout applies to a poll for the reply and the read follows it.
+   length[ID_HEADER] = MEMSIM_CMD_SIZE - 1;
+   ring_prep(&ring, IORING_OP_WRITE, fd, emu_cmd, length[ID_HEADER], IOSQE_IO_LINK | IOSQE_ASYNC, ID_HEADER);
+   for (i = 0; i < size; i += chunk)
+   {
+      chunks++;
+      length[chunks] = (size - i < chunk) ? size - i : chunk;
+      ring_prep(&ring, IORING_OP_WRITE, fd, data + i, length[chunks], IOSQE_IO_LINK | IOSQE_ASYNC,
+            chunks);
+   }
+   ring_prep(&ring, IORING_OP_POLL_ADD, fd, NULL, 0, IOSQE_IO_LINK, ID_POLL)->poll32_events = POLLIN;
+   ring_prep(&ring, IORING_OP_LINK_TIMEOUT, -1, &ts, 1, IOSQE_IO_LINK, ID_TIMEOUT);
+   length[ID_REPLY] = MEMSIM_CMD_SIZE - 1;
+   ring_prep(&ring, IORING_OP_READ, fd, reply, length[ID_REPLY], 0, ID_REPLY);
+   pending = chunks + 4;
+
+   if (progress) print_progress(0, size / divider);
+   if (ring_enter(&ring, pending, progress ? 1 : pending) < 0)
+   {
+      printf("Info: io_uring submission failed (%s), using write()\n", strerror(errno));
+      ring_close(&ring);
+      return URING_UNAVAILABLE;
+   }
+   while (pending > 0)
+   {
+      while (ring_reap(&ring, &cqe))
+      {
+         int id = cqe.user_data;
+
+         pending--;
+         done[id] = cqe.res;
+         if (id == ID_POLL || id == ID_TIMEOUT || cqe.res <= 0) continue;
+         if (id == ID_REPLY)
+            capture_record('R', (uint8_t *)reply, cqe.res);
+         else if (id == ID_HEADER)
+            capture_record('W', (const uint8_t *)emu_cmd, cqe.res);
+         else
+         {
+            capture_record('W', data + (id - 1) * chunk, cqe.res);
+            written += cqe.res;
+            if (progress) print_progress(written / divider, size / divider);
+            if (written == size)
+            {
+               stats_phase(PHASE_DATA, start);
+               data_done = stats_now();
+            }
+         }
+      }
+      if (pending > 0 && ring_enter(&ring, 0, 1) < 0)
+      {
+         perror("Error: io_uring_enter failed");
+         ring_close(&ring);
+         return -1;
+      }
+   }
+   ring_close(&ring);
+
+   // Kernels without read and write requests fail the first one, before
+   // anything was sent
+   if (done[ID_HEADER] == -EINVAL || done[ID_HEADER] == -EOPNOTSUPP)
+   {
+      printf("Info: io_uring can't write to the device, using write()\n");
+      return URING_UNAVAILABLE;
+   }
+   // A failed or short write cancels the rest of the chain, finish it
+   // the conventional way
+   for (i = ID_HEADER; i <= chunks; i++)
+   {
+      const uint8_t *p = (i == ID_HEADER) ? (const uint8_t *)emu_cmd : data + (i - 1) * chunk;
+      int rest = length[i] - (done[i] > 0 ? done[i] : 0);
+
+      if (done[i] < 0 && done[i] != -ECANCELED)
+      {
+         errno = -done[i];
+         printf("\n");
+         return -1;
+      }
+      if (rest > 0 && write_all(fd, p + length[i] - rest, rest, 0, 1) != rest)
+      {
+         printf("\n");
+         return -1;
+      }
+   }
+   if (written < size)
+   {
+      if (progress) print_progress(size / divider, size / divider);
+      stats_phase(PHASE_DATA, start);
+      data_done = stats_now();
+   }
+   // A reply may arrive in pieces, read the rest with the full timeout
+   if (done[ID_TIMEOUT] == -ETIME)
+      i = 0;
+   else if (done[ID_REPLY] < 0 && done[ID_REPLY] != -ECANCELED)
+   {
+      errno = -done[ID_REPLY];
+      i = -1;
+   }
+   else
+   {
+      i = (done[ID_REPLY] > 0) ? done[ID_REPLY] : 0;
+      if (i < length[ID_REPLY])
+      {
+         int r = read_all(fd, (uint8_t *)reply + i, length[ID_REPLY] - i, timeout);
+
+         i = (r > 0) ? i + r : r;
+      }
+   }
+   stats_phase(PHASE_REPLY, data_done);
+   return i;
+}
+
+#else
+
+int
+uring_upload(int fd, const char *emu_cmd, const uint8_t *data, int size, char *reply,
+      int timeout, bool progress, int divider)
+{
+   (void)fd; (void)emu_cmd; (void)data; (void)size; (void)reply;
+   (void)timeout; (void)progress; (void)divider;
+   printf("Info: io_uring support not built in (make URING=y), using write()\n");
+   return URING_UNAVAILABLE;
+}
+
+#endif